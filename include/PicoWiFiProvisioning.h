@@ -19,12 +19,35 @@
 #include <LittleFS.h>
 
 // Maximum number of WiFi networks that can be stored
+#ifndef MAX_WIFI_NETWORKS
 #define MAX_WIFI_NETWORKS 5
+#endif
 // Maximum length for SSID and password
 #define MAX_SSID_LENGTH 32
 #define MAX_PASSWORD_LENGTH 64
-// File used to store WiFi credentials
+// Bytes shared by the SSIDs and passwords of all stored networks. Each network
+// uses its SSID and password lengths plus two terminators. The default fits
+// MAX_WIFI_NETWORKS networks of maximum length; gateway builds can raise
+// MAX_WIFI_NETWORKS and keep a smaller arena sized for their typical networks.
+#ifndef WIFI_NETWORK_ARENA_SIZE
+#define WIFI_NETWORK_ARENA_SIZE (MAX_WIFI_NETWORKS * (MAX_SSID_LENGTH + MAX_PASSWORD_LENGTH + 2))
+#endif
+// Stored networks that can hold static IP settings or a cached lease at the same time
+#ifndef WIFI_IP_CONFIG_SLOTS
+#define WIFI_IP_CONFIG_SLOTS 2
+#endif
+// Files used to store WiFi credentials (A/B slots)
+#define WIFI_CONFIG_BIN_FILE "/wifi_config.bin"
+#define WIFI_CONFIG_BIN_B_FILE "/wifi_config_b.bin"
+// Legacy JSON credentials file, migrated to WIFI_CONFIG_BIN_FILE on first boot
 #define WIFI_CONFIG_FILE "/wifi_config.json"
+// Set to 0 to compile out the JSON parser and the legacy config migration
+#ifndef PICO_WIFI_PROVISIONING_LEGACY_JSON
+#define PICO_WIFI_PROVISIONING_LEGACY_JSON 1
+#endif
+
+// Backend persisting the stored networks, see PicoWiFiProvisioningStorage.h
+class PicoWiFiProvisioningStorage;
 
 // Status of the WiFi provisioning process
 typedef enum
@@ -37,43 +60,253 @@ typedef enum
     PROVISION_CONNECTED = 5
 } PicoWiFiProvisioningStatus;
 
-// Structure to hold WiFi network credentials
+// How a stored network gets its IPv4 settings
+typedef enum
+{
+    IP_CONFIG_DHCP = 0,        // Run DHCP on every join
+    IP_CONFIG_CACHED_LEASE = 1, // Reuse the lease from the last successful join, see setLeaseCaching()
+    IP_CONFIG_STATIC = 2        // Fixed settings provisioned with setNetworkStaticIP() or CMD_SET_STATIC_IP
+} PicoWiFiIPConfigMode;
+
+// IPv4 settings of a stored network, addresses as IPAddress converts them to uint32_t.
+// Kept outside WiFiNetworkConfig, only for the networks that use them.
 typedef struct
 {
-    char ssid[MAX_SSID_LENGTH + 1];
-    char password[MAX_PASSWORD_LENGTH + 1];
+    uint32_t address;
+    uint32_t subnet;
+    uint32_t gateway;
+    uint32_t dns;
+} WiFiIPConfig;
+
+// Descriptor of a stored WiFi network. The SSID and password live in the
+// credential arena as "ssid\0password\0" starting at ssidOffset, followed
+// by "staged\0" while a staged password update is pending.
+typedef struct
+{
+    uint32_t lastUsed;      // Logical time of the last save or successful connection (higher is more recent)
+    uint16_t successCount;  // Successful connections
+    uint16_t failureCount;  // Failed connection attempts
+    uint16_t ssidOffset;    // Offset of the SSID in the arena
+    uint8_t ssidLength;     // SSID length without terminator
+    uint8_t passwordLength; // Password length without terminator
+    uint8_t priority;       // Higher priorities are tried first (0 by default)
     bool enabled;
+    bool staged;                 // A staged password is being tried in place of the current one
+    uint8_t stagedLength;        // Staged password length without terminator
+    uint8_t stagedConfirmations; // Successful joins still needed to promote the staged password
+    uint8_t stagedFailures;      // Failed joins left before the staged password is rolled back
 } WiFiNetworkConfig;
 
+// Why the last join failed or the connection dropped
+typedef enum
+{
+    FAILURE_NONE = 0,
+    FAILURE_AUTH = 1,            // Rejected by the AP, usually a wrong password
+    FAILURE_NO_SSID = 2,         // No AP with this SSID in range
+    FAILURE_ASSOC_TIMEOUT = 3,   // No association within WIFI_CONNECT_TIMEOUT_MS
+    FAILURE_DHCP_TIMEOUT = 4,    // Associated but no IP address within WIFI_CONNECT_TIMEOUT_MS
+    FAILURE_LINK_LOST = 5,       // An established connection dropped
+    FAILURE_ASSOC_FAILED = 6     // The AP was found but association failed for another reason
+} PicoWiFiFailureReason;
+
+// Power-save mode of the CYW43 WiFi radio
+typedef enum
+{
+    POWER_MODE_UNMANAGED = 0,   // Leave the core's setting alone (default)
+    POWER_MODE_AUTO = 1,        // Performance while joining or transferring, power save when connected and idle
+    POWER_MODE_PERFORMANCE = 2, // CYW43_PERFORMANCE_PM
+    POWER_MODE_DEFAULT = 3,     // CYW43_DEFAULT_PM
+    POWER_MODE_POWER_SAVE = 4   // CYW43_AGGRESSIVE_PM
+} PicoWiFiPowerMode;
+
+// Identifies a join request, 0 means none
+typedef uint16_t PicoWiFiJoinId;
+
+// Picks the network to replace when the table is full.
+// Returns an index below count, or -1 to refuse the new network.
+typedef int (*PicoWiFiEvictionPolicy)(const WiFiNetworkConfig *networks, uint8_t count);
+
+// Built-in eviction policies
+int PicoWiFiEvictLeastRecentlyUsed(const WiFiNetworkConfig *networks, uint8_t count);
+int PicoWiFiEvictLeastSuccessful(const WiFiNetworkConfig *networks, uint8_t count);
+
+// Counters and timings for credential persistence and BLE provisioning sessions
+typedef struct
+{
+    uint32_t loadCount;       // Successful loads from flash
+    uint32_t saveCount;       // Successful saves to flash
+    uint32_t skippedSaves;    // saveNetwork() calls that changed nothing and were not written
+    uint32_t rejectedSaves;   // Credentials discarded because their validation join failed
+    uint32_t stagedPromotions; // Staged passwords that replaced the current one
+    uint32_t stagedRollbacks;  // Staged passwords dropped after exhausting their failure budget
+    uint32_t coalescedSaves;  // Changes merged into an already pending flash commit
+    uint32_t failedSaves;     // Flash commits that failed and were left pending
+    uint32_t evictions;       // Networks replaced because the table or the arena was full
+    uint32_t clearCount;      // Calls to clearNetworks()
+    uint32_t bytesWritten;    // Total bytes written to the config file
+    uint32_t lastLoadMicros;  // Duration of the last load
+    uint32_t lastSaveMicros;  // Duration of the last save
+    uint32_t lastClearMicros; // Duration of the last clear
+    uint32_t lastMigrationMicros; // Duration of the JSON to compact format migration
+    uint32_t legacyConfigBytes;   // Size of the migrated JSON file
+    uint32_t migratedConfigBytes; // Size of the compact image written by the migration
+    uint32_t advertisingStartMicros; // Time since reset when BLE advertising started
+    uint32_t credentialsReadyMicros; // Time since reset when stored networks were loaded
+    uint32_t wifiConnectedMicros;    // Time since reset when WiFi first connected
+    uint32_t joinStartMicros;        // Time since reset when the first WiFi join started
+    uint32_t bleReadyMicros;         // Time since reset when the BLE service was registered
+    uint32_t dedupedJoins;    // Join requests identical to the current or queued one, not restarted
+    uint32_t supersededJoins; // Joins preempted or queued requests replaced by a newer request
+    uint32_t cancelledJoins;  // Join requests cancelled with cancelJoin()
+    uint32_t quarantines;     // Stored networks quarantined after a failed join
+    uint32_t cachedLeaseJoins; // Joins that reused a cached lease instead of running DHCP
+    uint32_t droppedLeases;    // Cached leases forgotten after a failed join
+    uint32_t powerModeChanges; // Radio power-save mode changes made by the library
+    uint32_t arenaBytesUsed;  // Credential arena bytes used by the stored networks
+    uint32_t lastImageBytes;  // Size of the last config image written
+    uint32_t bleSessions;     // BLE connections accepted
+    uint32_t gattWrites;      // GATT writes received (including CCCD writes)
+    uint32_t gattReads;       // GATT reads served
+    uint32_t notifications;   // Notifications sent
+    uint32_t gattBytesIn;     // Payload bytes received over GATT
+    uint32_t gattBytesOut;    // Payload bytes sent over GATT (reads and notifications)
+    uint32_t lastSessionRoundTrips; // GATT operations from connect to the last save/connect command
+    uint32_t lastSessionMillis;     // Time from connect to the last save/connect command
+} PicoWiFiProvisioningStats;
+
+// Types of events recorded in provisioning traces
+typedef enum
+{
+    TRACE_BLE_CONNECTED = 1,
+    TRACE_BLE_DISCONNECTED = 2,
+    TRACE_GATT_WRITE = 3,
+    TRACE_GATT_READ = 4,
+    TRACE_WIFI_STATUS = 5,
+    TRACE_PROVISION_STATUS = 6
+} PicoWiFiProvisioningTraceType;
+
+// A single event of a provisioning trace
+typedef struct
+{
+    uint32_t timestampMicros;           // micros() when the event arrived
+    uint32_t durationMicros;            // Time spent processing the event
+    PicoWiFiProvisioningTraceType type; // Kind of event
+    uint16_t handle;                    // GATT handle for reads and writes, 0 otherwise
+    int32_t value;                      // BLE status, bytes read, WiFi or provisioning status
+    const uint8_t *data;                // Payload, nullptr if absent or redacted
+    uint16_t length;                    // Payload length (kept even when redacted)
+} PicoWiFiProvisioningTraceEvent;
+
 class PicoWiFiProvisioningClass
 {
 public:
     PicoWiFiProvisioningClass();
 
-    // Initialize the WiFi provisioning service
-    bool begin(const char *deviceName = "PicoW", BLESecurityLevel securityLevel = SECURITY_HIGH, io_capability_t ioCapability = IO_CAPABILITY_DISPLAY_YES_NO);
+    // Initialize the WiFi provisioning service and start advertising.
+    // Stored networks are loaded on first use or on the first loop() pass.
+    // joinStoredNetworks starts joining the stored networks before the BLE
+    // service is registered; advertising then starts if that join fails.
+    bool begin(const char *deviceName = "PicoW", BLESecurityLevel securityLevel = SECURITY_HIGH, io_capability_t ioCapability = IO_CAPABILITY_DISPLAY_YES_NO,
+               bool joinStoredNetworks = false);
+
+    // Rejoin the last connected network in begin() before starting BLE, which
+    // then only starts if that join fails or startBLE() is called. Call before begin().
+    void setFastBoot(bool enable);
+
+    // Start BLE provisioning and advertising if begin() deferred it
+    bool startBLE();
 
     // Process BLE and WiFi events - call this in your loop
     void loop();
 
-    // Save a new WiFi network configuration
+    // Save a new WiFi network configuration. Unchanged credentials are not
+    // rewritten; changes are committed to flash by loop() once no further
+    // change arrives for SAVE_COALESCE_MS, or by flush().
     bool saveNetwork(const char *ssid, const char *password);
 
-    // Connect to stored WiFi networks (try each one until successful)
+    // Join a network and save it only once the join succeeds. The outcome is
+    // reported through the status callback and the Status characteristic.
+    bool validateAndSaveNetwork(const char *ssid, const char *password);
+
+    // Make CMD_SAVE_NETWORK validate credentials by joining before saving them
+    void setValidateBeforeSave(bool validate);
+
+    // Stage a new password for a stored network. Joins try the new password
+    // while the current one is kept; it is promoted after `confirmations`
+    // successful joins and rolled back after `failureBudget` failed joins.
+    bool stageNetworkUpdate(const char *ssid, const char *newPassword, uint8_t confirmations = 3, uint8_t failureBudget = 3);
+
+    // Drop a staged password update and keep the current password
+    bool cancelNetworkUpdate(const char *ssid);
+
+    // Commit pending network changes to flash now
+    bool flush();
+
+    // Set the policy choosing which network a new one replaces when the table is full
+    // (least recently used by default, nullptr to reject new networks instead)
+    void setEvictionPolicy(PicoWiFiEvictionPolicy policy);
+
+    // Connect to stored WiFi networks (try each one until successful).
+    // Enabled networks are tried by priority; quarantined ones are skipped.
     bool connectToStoredNetworks();
 
-    // Connect to a specific network
+    // Forget all quarantines so every stored network is tried again
+    void clearQuarantine();
+
+    // Cache the IP settings obtained by DHCP for each stored network and reuse
+    // them on the next join of that network, skipping the DHCP exchange. The
+    // cached lease is dropped when a join with it fails. Only enable this where
+    // the DHCP server keeps addresses reserved or leases outlive the downtime.
+    void setLeaseCaching(bool enable);
+
+    // Connect to a specific network, preempting a different join in flight
     void connectToNetwork(const char *ssid, const char *password);
 
+    // Request a join. A request identical to the join in flight or the
+    // connected network returns that join's id without restarting it. A
+    // different request preempts the join in flight if preempt is set, and
+    // otherwise waits in a one-deep queue where the latest request wins.
+    // Returns 0 if the SSID is empty.
+    PicoWiFiJoinId requestJoin(const char *ssid, const char *password, bool preempt = false);
+
+    // Cancel a queued join, or stop the join in flight; false if id is neither
+    bool cancelJoin(PicoWiFiJoinId id);
+
     // Erase all stored WiFi networks
     bool clearNetworks();
 
     // Get the number of stored networks
     uint8_t getNetworkCount();
 
+    // Get the SSID of a stored network, nullptr if index is out of range
+    const char *getNetworkSSID(uint8_t index);
+
+    // Delete a single stored network by SSID or index
+    bool deleteNetwork(const char *ssid);
+    bool deleteNetworkAt(uint8_t index);
+
+    // Enable or disable a stored network by SSID or index, disabled networks are not joined
+    bool setNetworkEnabled(const char *ssid, bool enabled);
+    bool setNetworkEnabledAt(uint8_t index, bool enabled);
+
+    // Set the priority of a stored network by SSID or index, higher priorities are tried first
+    bool setNetworkPriority(const char *ssid, uint8_t priority);
+    bool setNetworkPriorityAt(uint8_t index, uint8_t priority);
+
+    // Give a stored network fixed IP settings by SSID or index, applied before
+    // each join of that network instead of DHCP. An address of 0.0.0.0
+    // returns the network to DHCP.
+    bool setNetworkStaticIP(const char *ssid, IPAddress address, IPAddress subnet, IPAddress gateway, IPAddress dns);
+    bool setNetworkStaticIPAt(uint8_t index, IPAddress address, IPAddress subnet, IPAddress gateway, IPAddress dns);
+
     // Get the current provisioning status
     PicoWiFiProvisioningStatus getStatus();
 
+    // Why the last join failed or the connection dropped, FAILURE_NONE while
+    // a join runs or after it succeeds. Already set when the status callback
+    // reports PROVISION_FAILED (or PROVISION_IDLE after a lost connection).
+    PicoWiFiFailureReason getLastFailureReason();
+
     // Set callback for status changes
     void setStatusCallback(void (*callback)(PicoWiFiProvisioningStatus status));
 
@@ -92,9 +325,20 @@ public:
     // Accept or reject numeric comparison
     void acceptNumericComparison(bool accept);
 
+    // Select where networks are persisted (LittleFS by default), call before begin()
+    void setStorage(PicoWiFiProvisioningStorage *storage);
+
     // Allow BLE connections when already connected to WiFi
     void allowProvisioningWhenConnected(bool allow);
 
+    // Select the radio power-save mode, or POWER_MODE_AUTO to let the
+    // provisioning status choose it
+    void setPowerMode(PicoWiFiPowerMode mode);
+
+    // Tell POWER_MODE_AUTO that the application is transferring data, which
+    // keeps the radio in performance mode until cleared
+    void setTransferActive(bool active);
+
     // Get the RSSI of the current WiFi connection
     int32_t getRSSI();
 
@@ -113,6 +357,24 @@ public:
     // Update the pairing status characteristic
     void updatePairingStatusCharacteristic(bool isPaired);
 
+    // Update the status characteristic with one of WiFiStatusCodes
+    void updateStatusCharacteristic(uint8_t statusCode);
+
+    // Get persistence and session counters and timings
+    const PicoWiFiProvisioningStats &getStats();
+
+    // Reset persistence and session counters and timings
+    void resetStats();
+
+    // Print the boot milestones from getStats()
+    void printBootTimeline(Print &out);
+
+    // Set callback receiving every BLE event, GATT access and status transition
+    void setTraceCallback(void (*callback)(const PicoWiFiProvisioningTraceEvent *event));
+
+    // Print a trace event as one line of the trace format
+    static void printTraceEvent(Print &out, const PicoWiFiProvisioningTraceEvent *event);
+
 private:
     // Track the currently connected device
     BLEDevice *_connectedDevice;
@@ -126,16 +388,33 @@ private:
     // Number of stored networks
     uint8_t _networkCount;
 
+    // Packed SSID and password strings of the stored networks, and bytes in use
+    char _arena[WIFI_NETWORK_ARENA_SIZE];
+    uint16_t _arenaUsed;
+
     // Track connection attempt start time
     unsigned long _connectionStartTime;
 
     // WiFi connection timeout (15 seconds)
     static const unsigned long WIFI_CONNECT_TIMEOUT_MS = 15000;
 
+    // Quiet period after the last change before pending changes are committed
+    static const unsigned long SAVE_COALESCE_MS = 500;
+
+    // Failed commits are retried after SAVE_COALESCE_MS doubled per failure, up to this many times
+    static const uint8_t SAVE_MAX_RETRIES = 5;
+
+    // Quarantine after a failed join, by failure reason, doubled per consecutive failure
+    static const unsigned long QUARANTINE_AUTH_MS = 300000;
+    static const unsigned long QUARANTINE_UNREACHABLE_MS = 60000;
+    static const unsigned long QUARANTINE_DHCP_MS = 30000;
+    static const uint8_t QUARANTINE_MAX_DOUBLINGS = 3;
+
     // Callbacks
     void (*_statusCallback)(PicoWiFiProvisioningStatus status);
     void (*_wifiStatusCallback)(wl_status_t status);
     void (*_bleConnectionStateCallback)(bool isConnected);
+    void (*_traceCallback)(const PicoWiFiProvisioningTraceEvent *event);
 
     // BLE related handles
     UUID _serviceUUID;
@@ -143,32 +422,292 @@ private:
     UUID _passwordCharUUID;
     UUID _commandCharUUID;
     UUID _pairingStatusCharUUID;
+    UUID _statusCharUUID;
     uint16_t _ssidCharHandle;
     uint16_t _passwordCharHandle;
     uint16_t _commandCharHandle;
     uint16_t _pairingStatusCharHandle;
+    uint16_t _statusCharHandle;
+
+    // Last value of the status characteristic (WiFiStatusCodes)
+    uint8_t _statusCode;
+
+    // Reason of the last join failure or connection loss
+    PicoWiFiFailureReason _failureReason;
 
     // Flag for allowing provisioning when already connected
     bool _allowProvisioningWhenConnected;
 
+    // Persistence and session counters and timings
+    PicoWiFiProvisioningStats _stats;
+
+    // Start time and GATT operation count of the current BLE session
+    unsigned long _sessionStartTime;
+    uint32_t _sessionRoundTrips;
+
+    // Backend persisting the stored networks
+    PicoWiFiProvisioningStorage *_storage;
+
+    // Storage mounted and networks loaded (both happen lazily after begin())
+    bool _storageReady;
+    bool _networksLoaded;
+
+    // Slot holding the newest valid image (-1 if none) and its sequence number
+    int8_t _activeSlot;
+    uint32_t _configSequence;
+
+    // Pending changes not yet committed to flash, and when the last one arrived
+    bool _dirty;
+    unsigned long _lastChangeTime;
+
+    // Consecutive failed commits, delays and finally stops the automatic retry
+    uint8_t _saveFailures;
+
+    // A save reported STATUS_SAVING and gets STATUS_SAVED once its commit succeeds
+    bool _saveReportPending;
+
+    // Policy choosing which network to replace when the table is full
+    PicoWiFiEvictionPolicy _evictionPolicy;
+
+    // Logical clock for WiFiNetworkConfig::lastUsed
+    uint32_t _useClock;
+
+    // Stored network being joined, -1 if the join is not for a stored network
+    int8_t _joiningIndex;
+
+    // The join uses the staged password of the stored network
+    bool _joiningStaged;
+
+    // Stored network to rejoin with its current password after its staged password failed, -1 if none
+    int8_t _stagedFallbackIndex;
+
+    // IP settings of the stored networks that do not use plain DHCP
+    struct IPConfigSlot
+    {
+        int8_t index; // Stored network, -1 when the slot is free
+        uint8_t mode; // PicoWiFiIPConfigMode
+        WiFiIPConfig ip;
+    };
+    IPConfigSlot _ipConfigs[WIFI_IP_CONFIG_SLOTS];
+
+    // Consecutive failed joins of each stored network, and the time in
+    // seconds (low 16 bits of millis() / 1000) until which passes skip it,
+    // 0 when it is not quarantined (RAM only)
+    uint8_t _strikes[MAX_WIFI_NETWORKS];
+    uint16_t _quarantineUntil[MAX_WIFI_NETWORKS];
+
+    // Stored networks already tried in the current pass, one bit each (RAM only)
+    uint8_t _triedNetworks[(MAX_WIFI_NETWORKS + 7) / 8];
+
+    // Fast boot enabled, and whether BLE has been started
+    bool _fastBoot;
+    bool _bleStarted;
+
+    // Advertising waits for the join started by begin() to end
+    bool _advertisingDeferred;
+
+    // BLE settings from begin(), kept for a deferred startBLE()
+    char _deviceName[30];
+    BLESecurityLevel _securityLevel;
+    io_capability_t _ioCapability;
+
+    // Stored network that joined successfully most recently, -1 if none (persisted for fast boot)
+    int8_t _lastConnectedIndex;
+
+    // A join request with its own copy of the credentials
+    struct JoinRequest
+    {
+        PicoWiFiJoinId id; // 0 when the slot is empty
+        char ssid[MAX_SSID_LENGTH + 1];
+        char password[MAX_PASSWORD_LENGTH + 1];
+    };
+
+    // Latest started join, the queued join that follows it, and the last id handed out
+    JoinRequest _activeJoin;
+    JoinRequest _queuedJoin;
+    PicoWiFiJoinId _nextJoinId;
+
+    // A connectToStoredNetworks() pass is running and falls back on failure
+    bool _storedPass;
+
+    // Power-save mode requested by the application, transfer hint for
+    // POWER_MODE_AUTO, and the CYW43 value last applied (0 if none)
+    PicoWiFiPowerMode _powerMode;
+    bool _transferActive;
+    uint32_t _appliedPm;
+
+    // Reuse cached DHCP leases, and whether the radio is set to a fixed address
+    bool _leaseCaching;
+    bool _staticIPApplied;
+
+    // Validate credentials by joining before saving them
+    bool _validateBeforeSave;
+
+    // Credentials waiting for their validation join to succeed
+    bool _pendingSave;
+    char _pendingSSID[MAX_SSID_LENGTH + 1];
+    char _pendingPassword[MAX_PASSWORD_LENGTH + 1];
+
     // String buffers for receiving WiFi credentials
     char _receivedSSID[MAX_SSID_LENGTH + 1];
     char _receivedPassword[MAX_PASSWORD_LENGTH + 1];
 
+    // Start BLE advertising and record when it first started
+    void startAdvertising();
+
+    // Mount the storage backend if not done yet
+    bool ensureStorage();
+
+    // Load stored WiFi networks if not done yet
+    bool ensureNetworksLoaded();
+
     // Load stored WiFi networks from flash
     bool loadNetworksFromFlash();
 
+    // Get the image in a storage slot, mapped or copied into the scratch buffer
+    const uint8_t *readSlotImage(uint8_t slot, size_t &size);
+
+#if PICO_WIFI_PROVISIONING_LEGACY_JSON
+    // Parse the JSON config file into the networks array
+    bool parseNetworksJson(File &configFile);
+
+    // Convert the legacy JSON config file into the compact format
+    bool migrateLegacyConfig(File &configFile);
+#endif
+
+    // Encode the networks array into a compact config image
+    size_t encodeNetworks(uint8_t *image, size_t capacity, uint32_t sequence);
+
+    // Decode a compact config image into the networks array
+    bool decodeNetworks(const uint8_t *image, size_t size);
+
     // Save WiFi networks to flash
     bool saveNetworksToFlash();
 
+    // Schedule a coalesced flash commit
+    void markDirty();
+
+    // Report STATUS_SAVED over BLE once pending changes are committed
+    void reportSaveWhenCommitted();
+
+    // Find a stored network by SSID, -1 if not stored
+    int findNetwork(const char *ssid);
+
+    // SSID and password of a stored network, pointing into the arena
+    const char *networkSSID(int index);
+    const char *networkPassword(int index);
+
+    // Append a network to the table, -1 if the table or the arena is full
+    int addNetwork(const char *ssid, size_t ssidLength, const char *password, size_t passwordLength);
+
+    // Replace the password of a stored network, false if the arena is full
+    bool setNetworkPassword(int index, const char *password);
+
+    // Replace the password and staged password (nullptr for none) of a stored network, false if the arena is full
+    bool setNetworkStrings(int index, const char *password, size_t passwordLength,
+                           const char *staged, size_t stagedLength);
+
+    // Staged password of a stored network, pointing into the arena
+    const char *networkStagedPassword(int index);
+
+    // Password to join a stored network with: the staged one while an update is pending
+    const char *networkJoinPassword(int index);
+
+    // Arena bytes used by a network's strings
+    static size_t networkArenaSize(const WiFiNetworkConfig &network);
+
+    // Remove a stored network and compact the table and the arena
+    void removeNetwork(int index);
+
+    // Write the strings of a network at the end of the arena
+    void storeNetworkStrings(WiFiNetworkConfig &network, const char *ssid, size_t ssidLength,
+                             const char *password, size_t passwordLength,
+                             const char *staged, size_t stagedLength);
+
+    // Drop the strings of a network from the arena, moving later strings down
+    void releaseNetworkStrings(int index);
+
+    // Forget all networks in RAM
+    void resetNetworks();
+
+    // Start joining a network, restarting the radio association
+    void startJoin(const char *ssid, const char *password);
+
+    // Whether a join request is for the given credentials
+    static bool joinRequestMatches(const JoinRequest &request, const char *ssid, const char *password);
+
+    // Next stored network to try in the current pass, -1 if none is left
+    int nextStoredNetwork();
+
+    // Start joining the next stored network of the current pass
+    bool joinNextStoredNetwork();
+
+    // Whether a stored network is in quarantine
+    bool isQuarantined(int index);
+
+    // Clear quarantine deadlines that have passed, before 16-bit seconds wrap
+    void expireQuarantines();
+
+    // IP settings slot of a stored network, nullptr if it uses plain DHCP
+    IPConfigSlot *findIPConfig(int index);
+
+    // Give a stored network IP settings, taking over the slot of the least
+    // recently used cached lease when none is free; false if all hold static settings
+    bool storeIPConfig(int index, uint8_t mode, const WiFiIPConfig &ip);
+
+    // Drop the side-table state of a removed network and renumber the networks after it
+    void removeNetworkState(int index);
+
+    // Quarantine a stored network after a failed join
+    void quarantineNetwork(int index, PicoWiFiFailureReason reason);
+
+    // End the join in flight as failed
+    void failJoin(PicoWiFiFailureReason reason);
+
+    // Failure reason of a join the WiFi stack reported as failed, from the CYW43 link state
+    PicoWiFiFailureReason connectFailureReason(wl_status_t wifiStatus);
+
+    // Failure reason of a join that timed out, from the CYW43 link state
+    PicoWiFiFailureReason timeoutFailureReason();
+
+    // Select DHCP or the fixed IP settings of the stored network for the next join
+    void applyIPConfig(int index);
+
+    // Remember the lease of the network that just connected
+    void cacheLease(int index);
+
+    // Update usage counters of the network being joined
+    void recordJoinOutcome(bool success);
+
+    // Save or discard credentials waiting for validation once their join ends
+    void completePendingSave(bool joined);
+
+    // Apply the power-save mode for the current status and requests, force
+    // rewrites it after the radio reset its own setting
+    void applyPowerMode(bool force = false);
+
     // Set the current status and call the callback if registered
     void setStatus(PicoWiFiProvisioningStatus status);
 
     // Setup BLE service and characteristics
     void setupBLEService();
 
-    // Process WiFi commands
-    void processCommand(uint8_t command);
+    // Process WiFi commands, args are the bytes following the command byte
+    void processCommand(uint8_t command, const uint8_t *args, uint16_t argsLength);
+
+    // Stored network targeted by a command: the index in args[indexPos] if
+    // present, otherwise the received SSID; -1 if none matches
+    int commandTarget(const uint8_t *args, uint16_t argsLength, uint16_t indexPos);
+
+    // Record round trips and elapsed time of the current BLE session
+    void recordSessionMilestone();
+
+    // Provide the value of a readable characteristic
+    uint16_t readCharacteristic(uint16_t characteristic_id, uint8_t *buffer, uint16_t buffer_size);
+
+    // Report an event to the trace callback if one is registered
+    void traceEvent(PicoWiFiProvisioningTraceType type, unsigned long startTime, uint16_t handle,
+                    int32_t value, const uint8_t *data = nullptr, uint16_t length = 0);
 
 };
 
@@ -184,7 +723,14 @@ enum WiFiCommands
     CMD_GET_STATUS = 0x04,
     CMD_DISCONNECT = 0x05,
     CMD_START_SCAN = 0x06,
-    CMD_GET_SCAN_RESULTS = 0x07
+    CMD_GET_SCAN_RESULTS = 0x07,
+    CMD_DELETE_NETWORK = 0x08,  // Target: [cmd, index], or the received SSID
+    CMD_ENABLE_NETWORK = 0x09,  // Target: [cmd, index], or the received SSID
+    CMD_DISABLE_NETWORK = 0x0A, // Target: [cmd, index], or the received SSID
+    CMD_SET_PRIORITY = 0x0B,    // [cmd, priority], target: [cmd, priority, index], or the received SSID
+    CMD_STAGE_NETWORK = 0x0C,   // Stage the received password for the received SSID, [cmd, confirmations, failure budget]
+    CMD_SET_STATIC_IP = 0x0D    // [cmd, address(4), subnet(4), gateway(4), dns(4)] or [cmd] for DHCP,
+                                // target: the index after the settings, or the received SSID
 };
 
 // Status codes for the status characteristic
@@ -0,0 +1,155 @@
+/**
+ * PicoWiFiProvisioningStorage.h - Storage backends for PicoWiFiProvisioning
+ *
+ * The provisioning library persists its networks as a single compact image.
+ * A storage backend only has to keep that image: read it back, replace it
+ * and erase it. Backends that offer two slots get crash-safe A/B saves: the
+ * library always overwrites the older slot and boots from the newest slot
+ * whose CRC checks out. Backends are provided for LittleFS (the default), a raw flash
+ * sector, the arduino-pico EEPROM emulation and plain RAM.
+ *
+ * Select a backend with PicoWiFiProvisioning.setStorage() before begin().
+ */
+
+#ifndef PICO_WIFI_PROVISIONING_STORAGE_H
+#define PICO_WIFI_PROVISIONING_STORAGE_H
+
+#include "PicoWiFiProvisioning.h"
+
+// Size of the config image header: magic(4) version(1) count(1) payload length(2) crc32(4) sequence(4)
+#define WIFI_CONFIG_HEADER_SIZE 16
+// Bytes of one network entry besides its SSID and password strings:
+// SSID and password tags (2 + 2), flags (2 + 1), usage (2 + 8), priority (2 + 1),
+// staged update tag and counters (2 + 2) and end tag (1)
+#define WIFI_CONFIG_ENTRY_OVERHEAD (2 + 2 + (2 + 1) + (2 + 8) + (2 + 1) + (2 + 2) + 1)
+// Bytes of the IP settings field, present in at most WIFI_IP_CONFIG_SLOTS entries
+#define WIFI_CONFIG_IP_FIELD_SIZE (2 + 17)
+// Worst-case size of the whole config image, the strings are bounded by the arena
+#define WIFI_CONFIG_IMAGE_MAX_SIZE (WIFI_CONFIG_HEADER_SIZE + MAX_WIFI_NETWORKS * WIFI_CONFIG_ENTRY_OVERHEAD + \
+                                    WIFI_IP_CONFIG_SLOTS * WIFI_CONFIG_IP_FIELD_SIZE + WIFI_NETWORK_ARENA_SIZE)
+
+// Interface for persisting the config image
+class PicoWiFiProvisioningStorage
+{
+public:
+    virtual ~PicoWiFiProvisioningStorage() {}
+
+    // Prepare the storage medium (mount, map, etc.)
+    virtual bool begin() = 0;
+
+    // Number of independent image slots (1 or 2)
+    virtual uint8_t slotCount() { return 1; }
+
+    // Read up to size bytes of the image in slot starting at offset, returns bytes read (0 if none stored)
+    virtual size_t read(uint8_t slot, size_t offset, uint8_t *buffer, size_t size) = 0;
+
+    // Replace the image in slot
+    virtual bool write(uint8_t slot, const uint8_t *image, size_t size) = 0;
+
+    // Remove the images in all slots
+    virtual bool erase() = 0;
+
+    // Pointer to the image in slot if it is memory-mapped, nullptr otherwise.
+    // Lets the loader decode straight from flash without copying.
+    virtual const uint8_t *map(uint8_t slot, size_t &size)
+    {
+        size = 0;
+        return nullptr;
+    }
+
+#if PICO_WIFI_PROVISIONING_LEGACY_JSON
+    // Open the legacy JSON config if this backend can hold one
+    virtual File openLegacyConfig() { return File(); }
+
+    // Remove the legacy JSON config after migration
+    virtual void removeLegacyConfig() {}
+#endif
+};
+
+// Stores the image in two slots on LittleFS, WIFI_CONFIG_BIN_FILE and WIFI_CONFIG_BIN_B_FILE
+class PicoWiFiLittleFSStorage : public PicoWiFiProvisioningStorage
+{
+public:
+    bool begin() override;
+    uint8_t slotCount() override { return 2; }
+    size_t read(uint8_t slot, size_t offset, uint8_t *buffer, size_t size) override;
+    bool write(uint8_t slot, const uint8_t *image, size_t size) override;
+    bool erase() override;
+
+#if PICO_WIFI_PROVISIONING_LEGACY_JSON
+    File openLegacyConfig() override;
+    void removeLegacyConfig() override;
+#endif
+};
+
+// Stores the image in dedicated 4 KB flash sectors, without a filesystem.
+// Records are already crash-safe, so this backend exposes a single slot.
+// Each save appends a record to the current sector and moves on to the next
+// sector (erasing it) when full, which spreads erases over all sectors.
+// A record only becomes valid once its header is programmed last, so an
+// interrupted save leaves the previous record in place.
+// Reads come straight from the XIP-mapped flash.
+// flashOffset is the offset of the first sector from the start of flash; the
+// sectorCount sectors must not overlap the sketch, LittleFS or EEPROM.
+class PicoWiFiFlashSectorStorage : public PicoWiFiProvisioningStorage
+{
+public:
+    PicoWiFiFlashSectorStorage(uint32_t flashOffset, uint8_t sectorCount = 2);
+
+    bool begin() override;
+    size_t read(uint8_t slot, size_t offset, uint8_t *buffer, size_t size) override;
+    bool write(uint8_t slot, const uint8_t *image, size_t size) override;
+    bool erase() override;
+    const uint8_t *map(uint8_t slot, size_t &size) override;
+
+private:
+    uint32_t _flashOffset;
+    uint8_t _sectorCount;
+
+    // Location of the newest record relative to _flashOffset, and where the next one goes
+    uint32_t _recordOffset;
+    uint16_t _recordSize;
+    uint32_t _sequence;
+    uint32_t _nextOffset;
+    bool _hasRecord;
+
+    // Check that a flash range is still erased
+    bool isErased(uint32_t offset, size_t size);
+};
+
+// Stores the image in the arduino-pico EEPROM emulation, starting at offset.
+// EEPROM commits rewrite the whole emulated sector, so a second slot would
+// not survive a brownout any better and only one is offered.
+// The EEPROM is shared with the application, which must keep clear of
+// [offset, offset + 2 + WIFI_CONFIG_IMAGE_MAX_SIZE).
+class PicoWiFiEEPROMStorage : public PicoWiFiProvisioningStorage
+{
+public:
+    PicoWiFiEEPROMStorage(uint16_t offset = 0);
+
+    bool begin() override;
+    size_t read(uint8_t slot, size_t offset, uint8_t *buffer, size_t size) override;
+    bool write(uint8_t slot, const uint8_t *image, size_t size) override;
+    bool erase() override;
+
+private:
+    uint16_t _offset;
+};
+
+// Keeps the image in RAM only, for tests and volatile deployments
+class PicoWiFiRAMStorage : public PicoWiFiProvisioningStorage
+{
+public:
+    PicoWiFiRAMStorage();
+
+    bool begin() override;
+    size_t read(uint8_t slot, size_t offset, uint8_t *buffer, size_t size) override;
+    bool write(uint8_t slot, const uint8_t *image, size_t size) override;
+    bool erase() override;
+
+private:
+    uint8_t _image[WIFI_CONFIG_IMAGE_MAX_SIZE];
+    size_t _size;
+};
+
+#endif // PICO_WIFI_PROVISIONING_STORAGE_H
@@ -5,7 +5,8 @@
  */
 
 #include "PicoWiFiProvisioning.h"
-#include <ArduinoJson.h>
+#include "PicoWiFiProvisioningStorage.h"
+#include <pico/cyw43_arch.h>
 
 // Define the UUIDs for service and characteristics
 static const char *SERVICE_UUID = "5a67d678-6361-4f32-8396-54c6926c8fa1";
@@ -13,6 +14,39 @@ static const char *SSID_CHAR_UUID = "5a67d678-6361-4f32-8396-54c6926c8fa2";
 static const char *PASSWORD_CHAR_UUID = "5a67d678-6361-4f32-8396-54c6926c8fa3";
 static const char *COMMAND_CHAR_UUID = "5a67d678-6361-4f32-8396-54c6926c8fa4";
 static const char *PAIRING_STATUS_CHAR_UUID = "5a67d678-6361-4f32-8396-54c6926c8fa5";
+static const char *STATUS_CHAR_UUID = "5a67d678-6361-4f32-8396-54c6926c8fa6";
+
+// Compact config image: a fixed header followed by one entry per network.
+// Each entry is a list of tag/length/value fields closed by NET_FIELD_END,
+// so fields can be added later without breaking older images.
+static const uint32_t CONFIG_IMAGE_MAGIC = 0x43505750; // "PWPC"
+static const uint8_t CONFIG_IMAGE_VERSION = 2;
+static const size_t CONFIG_HEADER_V1_SIZE = 12; // Version 1 had no sequence number
+
+enum NetworkFields
+{
+    NET_FIELD_END = 0x00,
+    NET_FIELD_SSID = 0x01,
+    NET_FIELD_PASSWORD = 0x02,
+    NET_FIELD_FLAGS = 0x03,
+    NET_FIELD_USAGE = 0x04,   // lastUsed(4) successCount(2) failureCount(2)
+    NET_FIELD_PRIORITY = 0x05, // priority(1), omitted when 0
+    NET_FIELD_STAGED = 0x06,   // confirmations(1) failures(1) password, only while an update is staged
+    NET_FIELD_IP = 0x07        // mode(1) address(4) subnet(4) gateway(4) dns(4), omitted for DHCP
+};
+
+static const uint8_t NET_FLAG_ENABLED = 0x01;
+static const uint8_t NET_FLAG_LAST_CONNECTED = 0x02; // Joined successfully most recently, used by fast boot
+
+static_assert(WIFI_NETWORK_ARENA_SIZE >= MAX_SSID_LENGTH + MAX_PASSWORD_LENGTH + 2 &&
+                  WIFI_NETWORK_ARENA_SIZE <= UINT16_MAX,
+              "WIFI_NETWORK_ARENA_SIZE must hold one network of maximum length and fit 16-bit offsets");
+
+// Scratch buffer for encoding and decoding config images
+static uint8_t configImage[WIFI_CONFIG_IMAGE_MAX_SIZE];
+
+// Storage used unless the application selects another backend
+static PicoWiFiLittleFSStorage defaultStorage;
 
 // Global instance
 PicoWiFiProvisioningClass PicoWiFiProvisioning;
@@ -26,48 +60,116 @@ uint16_t gattReadCallback(uint16_t characteristic_id, uint8_t *buffer, uint16_t
 // Constructor
 PicoWiFiProvisioningClass::PicoWiFiProvisioningClass() : _status(PROVISION_IDLE),
                                                          _networkCount(0),
+                                                         _arenaUsed(0),
                                                          _statusCallback(nullptr),
                                                          _wifiStatusCallback(nullptr),
                                                          _bleConnectionStateCallback(nullptr),
+                                                         _traceCallback(nullptr),
                                                          _serviceUUID(SERVICE_UUID),
                                                          _ssidCharUUID(SSID_CHAR_UUID),
                                                          _passwordCharUUID(PASSWORD_CHAR_UUID),
                                                          _commandCharUUID(COMMAND_CHAR_UUID),
                                                          _pairingStatusCharUUID(PAIRING_STATUS_CHAR_UUID),
+                                                         _statusCharUUID(STATUS_CHAR_UUID),
                                                          _ssidCharHandle(0),
                                                          _passwordCharHandle(0),
                                                          _commandCharHandle(0),
                                                          _pairingStatusCharHandle(0),
+                                                         _statusCharHandle(0),
+                                                         _statusCode(STATUS_IDLE),
+                                                         _failureReason(FAILURE_NONE),
                                                          _allowProvisioningWhenConnected(false),
                                                          _connectedDevice(nullptr),
-                                                         _connectionStartTime(0) // Initialized from pico_repo_3.txt
+                                                         _connectionStartTime(0), // Initialized from pico_repo_3.txt
+                                                         _sessionStartTime(0),
+                                                         _sessionRoundTrips(0),
+                                                         _storage(&defaultStorage),
+                                                         _storageReady(false),
+                                                         _networksLoaded(false),
+                                                         _activeSlot(-1),
+                                                         _configSequence(0),
+                                                         _dirty(false),
+                                                         _lastChangeTime(0),
+                                                         _saveFailures(0),
+                                                         _saveReportPending(false),
+                                                         _evictionPolicy(PicoWiFiEvictLeastRecentlyUsed),
+                                                         _useClock(0),
+                                                         _joiningIndex(-1),
+                                                         _joiningStaged(false),
+                                                         _stagedFallbackIndex(-1),
+                                                         _validateBeforeSave(false),
+                                                         _pendingSave(false),
+                                                         _fastBoot(false),
+                                                         _bleStarted(false),
+                                                         _advertisingDeferred(false),
+                                                         _securityLevel(SECURITY_HIGH),
+                                                         _ioCapability(IO_CAPABILITY_DISPLAY_YES_NO),
+                                                         _lastConnectedIndex(-1),
+                                                         _nextJoinId(0),
+                                                         _storedPass(false),
+                                                         _leaseCaching(false),
+                                                         _staticIPApplied(false),
+                                                         _powerMode(POWER_MODE_UNMANAGED),
+                                                         _transferActive(false),
+                                                         _appliedPm(0)
 {
     // Initialize string buffers
     memset(_receivedSSID, 0, sizeof(_receivedSSID));
     memset(_receivedPassword, 0, sizeof(_receivedPassword));
+    memset(_pendingSSID, 0, sizeof(_pendingSSID));
+    memset(_pendingPassword, 0, sizeof(_pendingPassword));
+    memset(_deviceName, 0, sizeof(_deviceName));
+    memset(&_activeJoin, 0, sizeof(_activeJoin));
+    memset(&_queuedJoin, 0, sizeof(_queuedJoin));
+    memset(&_stats, 0, sizeof(_stats));
 
     // Initialize networks array
-    for (int i = 0; i < MAX_WIFI_NETWORKS; i++)
+    resetNetworks();
+}
+
+// Initialize the WiFi provisioning service
+// Credentials are not needed to advertise, so storage is mounted and read
+// lazily: on first use, or on the first loop() pass after advertising starts.
+// With fast boot, a device whose last join succeeded rejoins that network
+// first and only starts BLE if the join fails or startBLE() is called.
+// With joinStoredNetworks, the stored-network join is started before the BLE
+// service is registered so association overlaps the BLE bring-up.
+bool PicoWiFiProvisioningClass::begin(const char *deviceName, BLESecurityLevel securityLevel, io_capability_t ioCapability,
+                                      bool joinStoredNetworks)
+{
+    strncpy(_deviceName, deviceName, sizeof(_deviceName) - 1);
+    _securityLevel = securityLevel;
+    _ioCapability = ioCapability;
+
+    if (_fastBoot && ensureNetworksLoaded() && _lastConnectedIndex >= 0 &&
+        _networks[_lastConnectedIndex].enabled)
+    {
+        Serial.println("Fast boot: rejoining the last connected network before starting BLE");
+        int index = _lastConnectedIndex;
+        connectToNetwork(networkSSID(index), networkJoinPassword(index));
+        if (_status == PROVISION_CONNECTING)
+        {
+            return true;
+        }
+    }
+    if (joinStoredNetworks && connectToStoredNetworks())
     {
-        memset(_networks[i].ssid, 0, sizeof(_networks[i].ssid));
-        memset(_networks[i].password, 0, sizeof(_networks[i].password));
-        _networks[i].enabled = false;
+        Serial.println("Joining stored network while BLE starts");
     }
+    return startBLE();
 }
 
-// Initialize the WiFi provisioning service
-bool PicoWiFiProvisioningClass::begin(const char *deviceName, BLESecurityLevel securityLevel, io_capability_t ioCapability)
+bool PicoWiFiProvisioningClass::startBLE()
 {
-    if (!LittleFS.begin())
+    if (_bleStarted)
     {
-        Serial.println("Failed to initialize LittleFS");
-        return false;
+        return true;
     }
-    loadNetworksFromFlash();
+    _bleStarted = true;
     BLENotify.begin();
-    BTstack.setup(deviceName);
-    BLESecure.begin(ioCapability);
-    BLESecure.setSecurityLevel(securityLevel, true);
+    BTstack.setup(_deviceName);
+    BLESecure.begin(_ioCapability);
+    BLESecure.setSecurityLevel(_securityLevel, true);
     BLESecure.allowReconnectionWithoutDatabaseEntry(true);
     BLESecure.requestPairingOnConnect(true); // Auto-request pairing
     BLESecure.setBLEDeviceConnectedCallback(bleDeviceConnected);
@@ -75,16 +177,83 @@ bool PicoWiFiProvisioningClass::begin(const char *deviceName, BLESecurityLevel s
     BTstack.setGATTCharacteristicWrite(gattWriteCallback);
     BTstack.setGATTCharacteristicRead(gattReadCallback);
     setupBLEService();
-    BTstack.startAdvertising();
+    _stats.bleReadyMicros = micros();
+    if (_status == PROVISION_CONNECTING)
+    { // Advertising stays off during joins, start it once this one ends
+        _advertisingDeferred = true;
+    }
+    else
+    {
+        startAdvertising();
+    }
     Serial.println("WiFi Provisioning service started");
     return true;
 }
 
+void PicoWiFiProvisioningClass::startAdvertising()
+{
+    BTstack.startAdvertising();
+    if (_stats.advertisingStartMicros == 0)
+    {
+        _stats.advertisingStartMicros = micros();
+    }
+}
+
+void PicoWiFiProvisioningClass::setFastBoot(bool enable)
+{
+    _fastBoot = enable;
+}
+
+// Mount the storage backend on first use
+bool PicoWiFiProvisioningClass::ensureStorage()
+{
+    if (!_storageReady)
+    {
+        _storageReady = _storage->begin();
+        if (!_storageReady)
+        {
+            Serial.println("Failed to initialize WiFi configuration storage");
+        }
+    }
+    return _storageReady;
+}
+
+// Load the stored networks on first use. Returns false while the storage
+// is not mounted, so changes that could never be persisted are refused.
+bool PicoWiFiProvisioningClass::ensureNetworksLoaded()
+{
+    if (_networksLoaded)
+    {
+        return _storageReady;
+    }
+    _networksLoaded = true; // Attempt once, a missing or bad config leaves the table empty
+    if (!ensureStorage())
+    {
+        return false;
+    }
+    loadNetworksFromFlash();
+    _stats.credentialsReadyMicros = micros();
+    return true;
+}
+
 // Process BLE and WiFi events
 void PicoWiFiProvisioningClass::loop()
 {
-    BTstack.loop();
-    BLENotify.update();
+    if (_bleStarted)
+    {
+        BTstack.loop();
+        BLENotify.update();
+    }
+    ensureNetworksLoaded();
+    expireQuarantines();
+
+    // Failed commits back off and stop retrying after SAVE_MAX_RETRIES,
+    // flush() and the next join still try
+    if (_dirty && _saveFailures < SAVE_MAX_RETRIES &&
+        millis() - _lastChangeTime >= (SAVE_COALESCE_MS << _saveFailures))
+    {
+        flush();
+    }
 
     wl_status_t currentWiFiStatus = (wl_status_t)WiFi.status();
     static wl_status_t lastReportedWiFiStatusToApp = WL_NO_SHIELD;
@@ -95,25 +264,77 @@ void PicoWiFiProvisioningClass::loop()
         if (currentWiFiStatus == WL_CONNECTED)
         {
             Serial.println("WiFi connected! (Detected in library loop's PROVISION_CONNECTING block)");
+            if (_stats.wifiConnectedMicros == 0)
+            {
+                _stats.wifiConnectedMicros = micros();
+            }
+            cacheLease(_joiningIndex);
+            recordJoinOutcome(true);
             setStatus(PROVISION_CONNECTED);
+            completePendingSave(true);
         }
         else if (currentWiFiStatus == WL_CONNECT_FAILED ||
                  currentWiFiStatus == WL_NO_SSID_AVAIL)
         {
             Serial.print("WiFi connection failed (Reported by WiFi stack in PROVISION_CONNECTING block): ");
             Serial.println(currentWiFiStatus);
-            setStatus(PROVISION_FAILED);
+            failJoin(connectFailureReason(currentWiFiStatus));
         }
         else if (currentTime - _connectionStartTime > WIFI_CONNECT_TIMEOUT_MS)
         {
             Serial.println("WiFi connection timed out. (Inside PROVISION_CONNECTING block timeout condition)");
-            setStatus(PROVISION_FAILED);
+            failJoin(timeoutFailureReason());
             WiFi.disconnect(); // Explicitly stop the WiFi connection attempt on timeout
         }
     }
 
+    if (_stagedFallbackIndex >= 0 && _status != PROVISION_CONNECTING)
+    { // A failed staged password costs one attempt: retry with the current one
+        int index = _stagedFallbackIndex;
+        _stagedFallbackIndex = -1;
+        if (_status == PROVISION_FAILED && _queuedJoin.id == 0 && index < _networkCount)
+        {
+            Serial.println("Staged password failed, retrying with the current password");
+            bool storedPass = _storedPass;
+            connectToNetwork(networkSSID(index), networkPassword(index));
+            _storedPass = storedPass && _status == PROVISION_CONNECTING; // Keep the pass going
+        }
+    }
+    if (_storedPass && _status != PROVISION_CONNECTING)
+    { // Fall back to the next stored network until one connects
+        _storedPass = false;
+        if (_status == PROVISION_FAILED && _queuedJoin.id == 0 && joinNextStoredNetwork())
+        {
+            Serial.println("Falling back to the next stored network");
+        }
+    }
+    if (_fastBoot && !_bleStarted && _queuedJoin.id == 0 &&
+        _status != PROVISION_CONNECTING && _status != PROVISION_CONNECTED)
+    { // Failed, cancelled or lost connection: the device must stay provisionable
+        Serial.println("Fast boot left WiFi disconnected, starting BLE provisioning");
+        startBLE();
+    }
+    if (_queuedJoin.id != 0 && _status != PROVISION_CONNECTING)
+    { // The latest queued request runs once the join before it ends
+        Serial.println("Starting queued join");
+        _activeJoin = _queuedJoin;
+        _queuedJoin.id = 0;
+        _storedPass = false;
+        startJoin(_activeJoin.ssid, _activeJoin.password);
+    }
+    if (_advertisingDeferred && _status != PROVISION_CONNECTING)
+    {
+        _advertisingDeferred = false;
+        if (_status != PROVISION_CONNECTED)
+        {
+            Serial.println("Boot join ended without a connection, starting BLE advertising");
+            startAdvertising();
+        }
+    }
+
     if (currentWiFiStatus != lastReportedWiFiStatusToApp)
     {
+        traceEvent(TRACE_WIFI_STATUS, micros(), 0, currentWiFiStatus);
         if (_wifiStatusCallback)
         {
             _wifiStatusCallback(currentWiFiStatus);
@@ -131,6 +352,7 @@ void PicoWiFiProvisioningClass::loop()
             if (_status == PROVISION_CONNECTED)
             {
                 Serial.println("WiFi connection lost (Detected post-connection in library loop).");
+                _failureReason = FAILURE_LINK_LOST;
                 setStatus(PROVISION_IDLE);
             }
             break;
@@ -139,12 +361,74 @@ void PicoWiFiProvisioningClass::loop()
     }
 }
 
+// The status characteristic carries [status code, failure reason]
+void PicoWiFiProvisioningClass::updateStatusCharacteristic(uint8_t statusCode)
+{
+    _statusCode = statusCode;
+    if (_bleStarted && BLENotify.isSubscribed(_statusCharHandle))
+    {
+        uint8_t value[2] = {_statusCode, (uint8_t)_failureReason};
+        BLENotify.notify(_statusCharHandle, value, sizeof(value));
+        _stats.notifications++;
+        _stats.gattBytesOut += sizeof(value);
+    }
+}
+
+void PicoWiFiProvisioningClass::failJoin(PicoWiFiFailureReason reason)
+{
+    _failureReason = reason;
+    recordJoinOutcome(false);
+    setStatus(PROVISION_FAILED);
+    completePendingSave(false);
+}
+
+// A timed out join either never associated or associated without getting an address
+PicoWiFiFailureReason PicoWiFiProvisioningClass::timeoutFailureReason()
+{
+    switch (cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA))
+    {
+    case CYW43_LINK_JOIN:
+    case CYW43_LINK_NOIP:
+        return FAILURE_DHCP_TIMEOUT;
+    case CYW43_LINK_BADAUTH:
+        return FAILURE_AUTH;
+    case CYW43_LINK_NONET:
+        return FAILURE_NO_SSID;
+    default:
+        return FAILURE_ASSOC_TIMEOUT;
+    }
+}
+
+// WiFi.status() folds every CYW43 join error into WL_CONNECT_FAILED, so the
+// driver's link status tells a wrong password from an AP out of range
+PicoWiFiFailureReason PicoWiFiProvisioningClass::connectFailureReason(wl_status_t wifiStatus)
+{
+    switch (cyw43_wifi_link_status(&cyw43_state, CYW43_ITF_STA))
+    {
+    case CYW43_LINK_BADAUTH:
+        return FAILURE_AUTH;
+    case CYW43_LINK_NONET:
+        return FAILURE_NO_SSID;
+    case CYW43_LINK_FAIL:
+        return FAILURE_ASSOC_FAILED;
+    default:
+        return wifiStatus == WL_NO_SSID_AVAIL ? FAILURE_NO_SSID : FAILURE_ASSOC_FAILED;
+    }
+}
+
+PicoWiFiFailureReason PicoWiFiProvisioningClass::getLastFailureReason()
+{
+    return _failureReason;
+}
+
 void PicoWiFiProvisioningClass::updatePairingStatusCharacteristic(bool isPaired)
 {
     uint8_t pairingStatus = isPaired ? PAIRING_STATUS_PAIRED : PAIRING_STATUS_NOT_PAIRED;
-    if (BLENotify.isSubscribed(_pairingStatusCharHandle))
+    if (_bleStarted && BLENotify.isSubscribed(_pairingStatusCharHandle))
     {
         BLENotify.notify(_pairingStatusCharHandle, &pairingStatus, 1);
+        _stats.notifications++;
+        _stats.gattBytesOut += 1;
         Serial.print("Sent pairing status update (from lib): ");
         Serial.println(pairingStatus);
     }
@@ -156,447 +440,2349 @@ bool PicoWiFiProvisioningClass::saveNetwork(const char *ssid, const char *passwo
     {
         return false;
     }
-    int existingIndex = -1;
-    for (int i = 0; i < _networkCount; i++)
+    if (!ensureNetworksLoaded())
     {
-        if (strcmp(_networks[i].ssid, ssid) == 0)
-        {
-            existingIndex = i;
-            break;
-        }
+        return false;
     }
+    int existingIndex = findNetwork(ssid);
     if (existingIndex >= 0)
     {
-        strncpy(_networks[existingIndex].password, password, MAX_PASSWORD_LENGTH);
+        if (_networks[existingIndex].enabled &&
+            strncmp(networkPassword(existingIndex), password, MAX_PASSWORD_LENGTH) == 0)
+        {
+            _stats.skippedSaves++; // Identical credentials re-sent, nothing to write
+            return true;
+        }
+        if (!setNetworkPassword(existingIndex, password))
+        {
+            return false; // No room in the arena
+        }
         _networks[existingIndex].enabled = true;
     }
-    else if (_networkCount < MAX_WIFI_NETWORKS)
-    {
-        strncpy(_networks[_networkCount].ssid, ssid, MAX_SSID_LENGTH);
-        strncpy(_networks[_networkCount].password, password, MAX_PASSWORD_LENGTH);
-        _networks[_networkCount].enabled = true;
-        _networkCount++;
-    }
     else
     {
-        return false; // No room
+        size_t ssidLength = min(strlen(ssid), (size_t)MAX_SSID_LENGTH);
+        size_t passwordLength = min(strlen(password), (size_t)MAX_PASSWORD_LENGTH);
+        // Evict until both a descriptor and enough arena bytes are free,
+        // the next commit writes the table once
+        bool evicted = false;
+        while (_networkCount >= MAX_WIFI_NETWORKS ||
+               _arenaUsed + ssidLength + passwordLength + 2 > (size_t)WIFI_NETWORK_ARENA_SIZE)
+        {
+            int victim = _evictionPolicy ? _evictionPolicy(_networks, _networkCount) : -1;
+            if (victim < 0 || victim >= _networkCount)
+            {
+                if (evicted)
+                {
+                    markDirty(); // Keep what was already evicted consistent on flash
+                }
+                return false; // No room
+            }
+            Serial.print("Network table full, replacing: ");
+            Serial.println(networkSSID(victim));
+            removeNetwork(victim);
+            _stats.evictions++;
+            evicted = true;
+        }
+        int index = addNetwork(ssid, ssidLength, password, passwordLength);
+        _networks[index].lastUsed = ++_useClock;
     }
-    return saveNetworksToFlash();
+    markDirty();
+    return true;
 }
 
-bool PicoWiFiProvisioningClass::connectToStoredNetworks()
+int PicoWiFiProvisioningClass::findNetwork(const char *ssid)
 {
-    if (_status == PROVISION_CONNECTING || _status == PROVISION_CONNECTED)
-    {
-        return false;
-    }
-    if (_networkCount == 0)
-    {
-        return false;
-    }
     for (int i = 0; i < _networkCount; i++)
     {
-        if (_networks[i].enabled)
+        if (strncmp(networkSSID(i), ssid, MAX_SSID_LENGTH) == 0)
         {
-            Serial.print("Attempting to connect to stored network (async): ");
-            Serial.println(_networks[i].ssid);
-            connectToNetwork(_networks[i].ssid, _networks[i].password);
-            if (_status == PROVISION_CONNECTING)
-            { // Check if connectToNetwork initiated an attempt
-                return true;
-            }
-            else
-            {
-                return false; // connectToNetwork did not start for some reason (e.g. empty SSID internally)
-            }
+            return i;
         }
     }
-    return false;
+    return -1;
 }
 
-void PicoWiFiProvisioningClass::connectToNetwork(const char *ssid, const char *password)
+const char *PicoWiFiProvisioningClass::networkSSID(int index)
 {
-    if (!ssid || strlen(ssid) == 0)
-    {
-        Serial.println("connectToNetwork: SSID is empty, connection attempt aborted.");
-        return;
-    }
+    return _arena + _networks[index].ssidOffset;
+}
 
-    setStatus(PROVISION_CONNECTING);
-    Serial.print("Attempting to connect to WiFi network (async): ");
-    Serial.println(ssid);
+const char *PicoWiFiProvisioningClass::networkPassword(int index)
+{
+    return _arena + _networks[index].ssidOffset + _networks[index].ssidLength + 1;
+}
 
-    Serial.println("Stopping BLE advertising during WiFi connection");
-    BTstack.stopAdvertising();
+const char *PicoWiFiProvisioningClass::networkStagedPassword(int index)
+{
+    return networkPassword(index) + _networks[index].passwordLength + 1;
+}
 
-    if (_connectedDevice != nullptr)
-    {
-        Serial.println("Disconnecting BLE device before WiFi connection");
-        BTstack.bleDisconnect(_connectedDevice);
-        // Note: _connectedDevice cleared in handleDeviceDisconnected
-    }
+const char *PicoWiFiProvisioningClass::networkJoinPassword(int index)
+{
+    return _networks[index].staged ? networkStagedPassword(index) : networkPassword(index);
+}
 
-    Serial.println("Proceeding to WiFi operations after BLE shutdown pause.");
+const char *PicoWiFiProvisioningClass::getNetworkSSID(uint8_t index)
+{
+    ensureNetworksLoaded();
+    return index < _networkCount ? networkSSID(index) : nullptr;
+}
 
-    if (WiFi.status() != WL_DISCONNECTED && WiFi.status() != WL_IDLE_STATUS)
+bool PicoWiFiProvisioningClass::deleteNetwork(const char *ssid)
+{
+    ensureNetworksLoaded();
+    int index = findNetwork(ssid);
+    return index >= 0 && deleteNetworkAt(index);
+}
+
+bool PicoWiFiProvisioningClass::deleteNetworkAt(uint8_t index)
+{
+    if (!ensureNetworksLoaded() || index >= _networkCount)
     {
-        Serial.println("Disconnecting from current WiFi network first...");
-        WiFi.disconnect();
-        // No delay here, WiFi.begin() will override/manage.
+        return false;
     }
+    Serial.print("Deleting stored network: ");
+    Serial.println(networkSSID(index));
+    removeNetwork(index);
+    markDirty();
+    return true;
+}
 
-    WiFi.begin(ssid, password);
-    _connectionStartTime = millis();
+bool PicoWiFiProvisioningClass::setNetworkEnabled(const char *ssid, bool enabled)
+{
+    ensureNetworksLoaded();
+    int index = findNetwork(ssid);
+    return index >= 0 && setNetworkEnabledAt(index, enabled);
 }
 
-bool PicoWiFiProvisioningClass::clearNetworks()
+bool PicoWiFiProvisioningClass::setNetworkEnabledAt(uint8_t index, bool enabled)
 {
-    for (int i = 0; i < MAX_WIFI_NETWORKS; i++)
+    if (!ensureNetworksLoaded() || index >= _networkCount)
     {
-        memset(_networks[i].ssid, 0, sizeof(_networks[i].ssid));
-        memset(_networks[i].password, 0, sizeof(_networks[i].password));
-        _networks[i].enabled = false;
+        return false;
     }
-    _networkCount = 0;
-    if (LittleFS.exists(WIFI_CONFIG_FILE))
+    if (_networks[index].enabled == enabled)
     {
-        LittleFS.remove(WIFI_CONFIG_FILE);
+        _stats.skippedSaves++;
+        return true;
     }
+    _networks[index].enabled = enabled;
+    markDirty();
     return true;
 }
 
-uint8_t PicoWiFiProvisioningClass::getNetworkCount()
+bool PicoWiFiProvisioningClass::setNetworkPriority(const char *ssid, uint8_t priority)
 {
-    return _networkCount;
+    ensureNetworksLoaded();
+    int index = findNetwork(ssid);
+    return index >= 0 && setNetworkPriorityAt(index, priority);
 }
 
-PicoWiFiProvisioningStatus PicoWiFiProvisioningClass::getStatus()
+bool PicoWiFiProvisioningClass::setNetworkPriorityAt(uint8_t index, uint8_t priority)
 {
-    return _status;
+    if (!ensureNetworksLoaded() || index >= _networkCount)
+    {
+        return false;
+    }
+    if (_networks[index].priority == priority)
+    {
+        _stats.skippedSaves++;
+        return true;
+    }
+    _networks[index].priority = priority;
+    markDirty();
+    return true;
 }
 
-// Set the current status and call the callback if registered
-void PicoWiFiProvisioningClass::setStatus(PicoWiFiProvisioningStatus newStatus)
+bool PicoWiFiProvisioningClass::setNetworkStaticIP(const char *ssid, IPAddress address, IPAddress subnet, IPAddress gateway, IPAddress dns)
 {
-    if (_status != newStatus)
+    ensureNetworksLoaded();
+    int index = findNetwork(ssid);
+    return index >= 0 && setNetworkStaticIPAt(index, address, subnet, gateway, dns);
+}
+
+bool PicoWiFiProvisioningClass::setNetworkStaticIPAt(uint8_t index, IPAddress address, IPAddress subnet, IPAddress gateway, IPAddress dns)
+{
+    if (!ensureNetworksLoaded() || index >= _networkCount)
     {
-        // Serial.print(millis());                                                // DEBUG
-        // Serial.print("ms: PicoWiFiProvisioningClass::_status changing from "); // DEBUG
-        // Serial.print(_status);                                                 // DEBUG
-        // Serial.print(" to ");                                                  // DEBUG
-        // Serial.println(newStatus);                                             // DEBUG
-        _status = newStatus;
-        if (_statusCallback)
-        {
-            _statusCallback(_status);
+        return false;
+    }
+    IPConfigSlot *slot = findIPConfig(index);
+    if ((uint32_t)address == 0)
+    {
+        if (!slot || slot->mode != IP_CONFIG_STATIC)
+        { // Already on DHCP, possibly with a cached lease that stays
+            _stats.skippedSaves++;
+            return true;
         }
+        slot->index = -1;
+        markDirty();
+        return true;
     }
-    else
+    WiFiIPConfig ip;
+    ip.address = (uint32_t)address;
+    ip.subnet = (uint32_t)subnet;
+    ip.gateway = (uint32_t)gateway;
+    ip.dns = (uint32_t)dns;
+    if (slot && slot->mode == IP_CONFIG_STATIC && memcmp(&slot->ip, &ip, sizeof(ip)) == 0)
     {
-        // Optional: Log if setStatus is called but status doesn't change
-        // Serial.print(millis()); // DEBUG
-        // Serial.print("ms: PicoWiFiProvisioningClass::setStatus called with same status: "); // DEBUG
-        // Serial.println(newStatus); // DEBUG
+        _stats.skippedSaves++;
+        return true;
+    }
+    if (!storeIPConfig(index, IP_CONFIG_STATIC, ip))
+    {
+        Serial.println("No free slot for static IP settings, raise WIFI_IP_CONFIG_SLOTS");
+        return false;
     }
+    markDirty();
+    return true;
 }
 
-// --------------- ADDED MISSING DEFINITION ---------------
-// Set callback for status changes
-void PicoWiFiProvisioningClass::setStatusCallback(void (*callback)(PicoWiFiProvisioningStatus status))
+PicoWiFiProvisioningClass::IPConfigSlot *PicoWiFiProvisioningClass::findIPConfig(int index)
 {
-    _statusCallback = callback;
+    for (int i = 0; i < WIFI_IP_CONFIG_SLOTS; i++)
+    {
+        if (_ipConfigs[i].index == index)
+        {
+            return &_ipConfigs[i];
+        }
+    }
+    return nullptr;
 }
-// -------------------------------------------------------
 
-void PicoWiFiProvisioningClass::setWiFiStatusCallback(void (*callback)(wl_status_t status))
+bool PicoWiFiProvisioningClass::storeIPConfig(int index, uint8_t mode, const WiFiIPConfig &ip)
 {
-    _wifiStatusCallback = callback;
+    IPConfigSlot *slot = findIPConfig(index);
+    if (!slot)
+    {
+        slot = findIPConfig(-1);
+    }
+    if (!slot)
+    {
+        for (int i = 0; i < WIFI_IP_CONFIG_SLOTS; i++)
+        {
+            if (_ipConfigs[i].mode == IP_CONFIG_CACHED_LEASE &&
+                (!slot || _networks[_ipConfigs[i].index].lastUsed < _networks[slot->index].lastUsed))
+            {
+                slot = &_ipConfigs[i];
+            }
+        }
+    }
+    if (!slot)
+    {
+        return false;
+    }
+    slot->index = index;
+    slot->mode = mode;
+    slot->ip = ip;
+    return true;
 }
 
-void PicoWiFiProvisioningClass::setBLEConnectionStateCallback(void (*callback)(bool isConnected))
+int PicoWiFiProvisioningClass::addNetwork(const char *ssid, size_t ssidLength, const char *password, size_t passwordLength)
 {
-    _bleConnectionStateCallback = callback;
+    ssidLength = min(ssidLength, (size_t)MAX_SSID_LENGTH);
+    passwordLength = min(passwordLength, (size_t)MAX_PASSWORD_LENGTH);
+    if (_networkCount >= MAX_WIFI_NETWORKS ||
+        _arenaUsed + ssidLength + passwordLength + 2 > (size_t)WIFI_NETWORK_ARENA_SIZE)
+    {
+        return -1;
+    }
+    WiFiNetworkConfig &network = _networks[_networkCount];
+    memset(&network, 0, sizeof(network));
+    network.enabled = true;
+    storeNetworkStrings(network, ssid, ssidLength, password, passwordLength, nullptr, 0);
+    return _networkCount++;
 }
 
-void PicoWiFiProvisioningClass::setPasskeyDisplayCallback(void (*callback)(uint32_t passkey))
+// Replacing the password drops any staged update
+bool PicoWiFiProvisioningClass::setNetworkPassword(int index, const char *password)
 {
-    BLESecure.setPasskeyDisplayCallback(callback);
+    return setNetworkStrings(index, password, strlen(password), nullptr, 0);
 }
 
-void PicoWiFiProvisioningClass::setNumericComparisonCallback(void (*callback)(uint32_t passkey, BLEDevice *device))
+bool PicoWiFiProvisioningClass::setNetworkStrings(int index, const char *password, size_t passwordLength,
+                                                  const char *staged, size_t stagedLength)
 {
-    BLESecure.setNumericComparisonCallback(callback);
+    WiFiNetworkConfig &network = _networks[index];
+    passwordLength = min(passwordLength, (size_t)MAX_PASSWORD_LENGTH);
+    stagedLength = min(stagedLength, (size_t)MAX_PASSWORD_LENGTH);
+    size_t size = network.ssidLength + passwordLength + 2 + (staged ? stagedLength + 1 : 0);
+    if (_arenaUsed - networkArenaSize(network) + size > WIFI_NETWORK_ARENA_SIZE)
+    {
+        return false;
+    }
+    // The new strings may point into the arena, copy everything out first
+    char ssidCopy[MAX_SSID_LENGTH + 1];
+    char passwordCopy[MAX_PASSWORD_LENGTH + 1];
+    char stagedCopy[MAX_PASSWORD_LENGTH + 1];
+    memcpy(ssidCopy, networkSSID(index), network.ssidLength);
+    memcpy(passwordCopy, password, passwordLength);
+    if (staged)
+    {
+        memcpy(stagedCopy, staged, stagedLength);
+    }
+    releaseNetworkStrings(index);
+    storeNetworkStrings(network, ssidCopy, network.ssidLength, passwordCopy, passwordLength,
+                        staged ? stagedCopy : nullptr, stagedLength);
+    return true;
 }
 
-void PicoWiFiProvisioningClass::acceptNumericComparison(bool accept)
+void PicoWiFiProvisioningClass::removeNetwork(int index)
 {
-    BLESecure.acceptNumericComparison(accept);
+    releaseNetworkStrings(index);
+    memmove(&_networks[index], &_networks[index + 1], (_networkCount - index - 1) * sizeof(WiFiNetworkConfig));
+    _networkCount--;
+    memset(&_networks[_networkCount], 0, sizeof(WiFiNetworkConfig));
+    removeNetworkState(index);
+    _stagedFallbackIndex = -1;
+    if (_joiningIndex == index)
+    {
+        _joiningIndex = -1;
+    }
+    else if (_joiningIndex > index)
+    {
+        _joiningIndex--;
+    }
+    if (_lastConnectedIndex == index)
+    {
+        _lastConnectedIndex = -1;
+    }
+    else if (_lastConnectedIndex > index)
+    {
+        _lastConnectedIndex--;
+    }
 }
 
-void PicoWiFiProvisioningClass::allowProvisioningWhenConnected(bool allow)
+void PicoWiFiProvisioningClass::storeNetworkStrings(WiFiNetworkConfig &network, const char *ssid, size_t ssidLength,
+                                                    const char *password, size_t passwordLength,
+                                                    const char *staged, size_t stagedLength)
 {
-    _allowProvisioningWhenConnected = allow;
+    char *dest = _arena + _arenaUsed;
+    memcpy(dest, ssid, ssidLength);
+    dest[ssidLength] = '\0';
+    memcpy(dest + ssidLength + 1, password, passwordLength);
+    dest[ssidLength + 1 + passwordLength] = '\0';
+    if (staged)
+    {
+        memcpy(dest + ssidLength + passwordLength + 2, staged, stagedLength);
+        dest[ssidLength + passwordLength + 2 + stagedLength] = '\0';
+    }
+    network.ssidOffset = _arenaUsed;
+    network.ssidLength = ssidLength;
+    network.passwordLength = passwordLength;
+    network.staged = staged != nullptr;
+    network.stagedLength = staged ? stagedLength : 0;
+    _arenaUsed += networkArenaSize(network);
 }
 
-int32_t PicoWiFiProvisioningClass::getRSSI()
+size_t PicoWiFiProvisioningClass::networkArenaSize(const WiFiNetworkConfig &network)
 {
-    return WiFi.RSSI();
+    return network.ssidLength + network.passwordLength + 2 + (network.staged ? network.stagedLength + 1 : 0);
 }
 
-// BTstack global callback Trampolines
-void bleDeviceConnected(BLEStatus status, BLEDevice *device)
+void PicoWiFiProvisioningClass::releaseNetworkStrings(int index)
+{
+    uint16_t offset = _networks[index].ssidOffset;
+    uint16_t size = networkArenaSize(_networks[index]);
+    memmove(_arena + offset, _arena + offset + size, _arenaUsed - offset - size);
+    _arenaUsed -= size;
+    for (int i = 0; i < _networkCount; i++)
+    {
+        if (_networks[i].ssidOffset > offset)
+        {
+            _networks[i].ssidOffset -= size;
+        }
+    }
+}
+
+void PicoWiFiProvisioningClass::resetNetworks()
+{
+    memset(_networks, 0, sizeof(_networks));
+    memset(_arena, 0, sizeof(_arena));
+    _networkCount = 0;
+    _arenaUsed = 0;
+    _lastConnectedIndex = -1;
+    _stagedFallbackIndex = -1;
+    for (int i = 0; i < WIFI_IP_CONFIG_SLOTS; i++)
+    {
+        _ipConfigs[i].index = -1;
+    }
+    clearQuarantine();
+    memset(_triedNetworks, 0, sizeof(_triedNetworks));
+}
+
+void PicoWiFiProvisioningClass::removeNetworkState(int index)
+{
+    for (int i = 0; i < WIFI_IP_CONFIG_SLOTS; i++)
+    {
+        if (_ipConfigs[i].index == index)
+        {
+            _ipConfigs[i].index = -1;
+        }
+        else if (_ipConfigs[i].index > index)
+        {
+            _ipConfigs[i].index--;
+        }
+    }
+    memmove(&_strikes[index], &_strikes[index + 1], MAX_WIFI_NETWORKS - index - 1);
+    memmove(&_quarantineUntil[index], &_quarantineUntil[index + 1], (MAX_WIFI_NETWORKS - index - 1) * sizeof(uint16_t));
+    _strikes[MAX_WIFI_NETWORKS - 1] = 0;
+    _quarantineUntil[MAX_WIFI_NETWORKS - 1] = 0;
+    for (int i = index; i < MAX_WIFI_NETWORKS; i++)
+    {
+        bool tried = i + 1 < MAX_WIFI_NETWORKS && (_triedNetworks[(i + 1) / 8] & (1 << ((i + 1) % 8)));
+        if (tried)
+        {
+            _triedNetworks[i / 8] |= 1 << (i % 8);
+        }
+        else
+        {
+            _triedNetworks[i / 8] &= ~(1 << (i % 8));
+        }
+    }
+}
+
+// Usage counters only change in RAM here; they reach flash with the next
+// commit instead of costing a flash write per connection.
+void PicoWiFiProvisioningClass::recordJoinOutcome(bool success)
+{
+    if (_joiningIndex < 0 || _joiningIndex >= _networkCount)
+    {
+        return;
+    }
+    int index = _joiningIndex;
+    WiFiNetworkConfig &network = _networks[index];
+    if (success)
+    {
+        network.lastUsed = ++_useClock;
+        if (network.successCount < UINT16_MAX)
+            network.successCount++;
+        _strikes[index] = 0;
+        _quarantineUntil[index] = 0;
+    }
+    else
+    {
+        if (network.failureCount < UINT16_MAX)
+            network.failureCount++;
+        if (_joiningStaged && network.staged)
+        { // Only the staged password failed, the current one is tried next
+            _stagedFallbackIndex = index;
+        }
+        else
+        {
+            quarantineNetwork(index, _failureReason);
+        }
+        IPConfigSlot *slot = findIPConfig(index);
+        if (slot && slot->mode == IP_CONFIG_CACHED_LEASE &&
+            (_failureReason == FAILURE_DHCP_TIMEOUT || _failureReason == FAILURE_ASSOC_TIMEOUT))
+        { // The address may have moved on, run DHCP next time
+            slot->index = -1;
+            _stats.droppedLeases++;
+            markDirty();
+        }
+    }
+    _joiningIndex = -1;
+
+    // Remember the last network that connected for fast boot, written only when it changes
+    if (success && _lastConnectedIndex != index)
+    {
+        _lastConnectedIndex = index;
+        markDirty();
+    }
+    else if (!success && _lastConnectedIndex == index)
+    {
+        _lastConnectedIndex = -1;
+        markDirty();
+    }
+
+    // Staged updates move towards promotion or rollback, written to flash right
+    // away so a reboot loop cannot reset the budget
+    if (_joiningStaged && network.staged)
+    {
+        if (success && network.stagedConfirmations <= 1)
+        {
+            Serial.print("Staged password promoted for: ");
+            Serial.println(networkSSID(index));
+            setNetworkStrings(index, networkStagedPassword(index), network.stagedLength, nullptr, 0);
+            network.stagedFailures = 0;
+            _stats.stagedPromotions++;
+        }
+        else if (!success && (network.stagedFailures <= 1))
+        {
+            Serial.print("Staged password rolled back for: ");
+            Serial.println(networkSSID(index));
+            setNetworkStrings(index, networkPassword(index), network.passwordLength, nullptr, 0);
+            network.stagedConfirmations = 0;
+            network.stagedFailures = 0;
+            _stats.stagedRollbacks++;
+        }
+        else if (success)
+        {
+            network.stagedConfirmations--;
+        }
+        else
+        {
+            network.stagedFailures--;
+        }
+        markDirty();
+        flush();
+    }
+    _joiningStaged = false;
+}
+
+bool PicoWiFiProvisioningClass::stageNetworkUpdate(const char *ssid, const char *newPassword, uint8_t confirmations, uint8_t failureBudget)
+{
+    if (!ssid || !newPassword || !ensureNetworksLoaded())
+    {
+        return false;
+    }
+    int index = findNetwork(ssid);
+    if (index < 0)
+    {
+        return false;
+    }
+    WiFiNetworkConfig &network = _networks[index];
+    if (!setNetworkStrings(index, networkPassword(index), network.passwordLength, newPassword, strlen(newPassword)))
+    {
+        return false; // No room in the arena for both passwords
+    }
+    network.stagedConfirmations = max(confirmations, (uint8_t)1);
+    network.stagedFailures = max(failureBudget, (uint8_t)1);
+    if (_joiningIndex == index)
+    {
+        _joiningStaged = false; // The join in progress uses the old strings
+    }
+    Serial.print("Staged password update for: ");
+    Serial.println(ssid);
+    markDirty();
+    return true;
+}
+
+bool PicoWiFiProvisioningClass::cancelNetworkUpdate(const char *ssid)
+{
+    if (!ssid || !ensureNetworksLoaded())
+    {
+        return false;
+    }
+    int index = findNetwork(ssid);
+    if (index < 0 || !_networks[index].staged)
+    {
+        return false;
+    }
+    setNetworkStrings(index, networkPassword(index), _networks[index].passwordLength, nullptr, 0);
+    _networks[index].stagedConfirmations = 0;
+    _networks[index].stagedFailures = 0;
+    markDirty();
+    return true;
+}
+
+bool PicoWiFiProvisioningClass::validateAndSaveNetwork(const char *ssid, const char *password)
+{
+    if (!ssid || strlen(ssid) == 0)
+    {
+        return false;
+    }
+    connectToNetwork(ssid, password);
+    if (_status == PROVISION_CONNECTED)
+    { // Already connected with these credentials, nothing left to validate
+        return saveNetwork(ssid, password);
+    }
+    if (_status != PROVISION_CONNECTING)
+    {
+        return false;
+    }
+    // Copied after the join started, starting a join drops earlier pending credentials
+    strncpy(_pendingSSID, ssid, MAX_SSID_LENGTH);
+    strncpy(_pendingPassword, password, MAX_PASSWORD_LENGTH);
+    _pendingSave = true;
+    return true;
+}
+
+void PicoWiFiProvisioningClass::completePendingSave(bool joined)
+{
+    if (!_pendingSave)
+    {
+        return;
+    }
+    _pendingSave = false;
+    if (!joined)
+    {
+        Serial.print("Credentials not saved, validation join failed: ");
+        Serial.println(_pendingSSID);
+        _stats.rejectedSaves++;
+    }
+    else if (!saveNetwork(_pendingSSID, _pendingPassword))
+    { // Joined, but no room in the table or no storage
+        Serial.print("Validated network could not be saved: ");
+        Serial.println(_pendingSSID);
+        updateStatusCharacteristic(STATUS_FAILED);
+    }
+    else
+    {
+        Serial.println("Validated network saved");
+        int index = findNetwork(_pendingSSID);
+        if (index >= 0)
+        {
+            if (_networks[index].successCount == 0)
+            {
+                _networks[index].successCount = 1; // The validation join counts
+            }
+            _lastConnectedIndex = index;
+        }
+        reportSaveWhenCommitted();
+    }
+    memset(_pendingSSID, 0, sizeof(_pendingSSID));
+    memset(_pendingPassword, 0, sizeof(_pendingPassword));
+}
+
+void PicoWiFiProvisioningClass::setValidateBeforeSave(bool validate)
+{
+    _validateBeforeSave = validate;
+}
+
+void PicoWiFiProvisioningClass::setEvictionPolicy(PicoWiFiEvictionPolicy policy)
+{
+    _evictionPolicy = policy;
+}
+
+int PicoWiFiEvictLeastRecentlyUsed(const WiFiNetworkConfig *networks, uint8_t count)
+{
+    int victim = -1;
+    for (int i = 0; i < count; i++)
+    {
+        if (victim < 0 || networks[i].lastUsed < networks[victim].lastUsed)
+        {
+            victim = i;
+        }
+    }
+    return victim;
+}
+
+int PicoWiFiEvictLeastSuccessful(const WiFiNetworkConfig *networks, uint8_t count)
+{
+    int victim = -1;
+    for (int i = 0; i < count; i++)
+    {
+        if (victim < 0)
+        {
+            victim = i;
+            continue;
+        }
+        const WiFiNetworkConfig &a = networks[i];
+        const WiFiNetworkConfig &b = networks[victim];
+        // Fewest successes, then most failures, then least recently used
+        if (a.successCount != b.successCount ? a.successCount < b.successCount
+            : a.failureCount != b.failureCount ? a.failureCount > b.failureCount
+                                                : a.lastUsed < b.lastUsed)
+        {
+            victim = i;
+        }
+    }
+    return victim;
+}
+
+// Schedule a flash commit, merging changes that arrive within SAVE_COALESCE_MS
+void PicoWiFiProvisioningClass::markDirty()
+{
+    if (_dirty)
+    {
+        _stats.coalescedSaves++;
+    }
+    _dirty = true;
+    _lastChangeTime = millis();
+}
+
+bool PicoWiFiProvisioningClass::flush()
+{
+    if (!_dirty)
+    {
+        return true;
+    }
+    _dirty = false;
+    if (!saveNetworksToFlash())
+    {
+        _dirty = true; // Retry after a longer window
+        _lastChangeTime = millis();
+        if (_saveReportPending && _saveFailures == 0)
+        {
+            updateStatusCharacteristic(STATUS_FAILED); // STATUS_SAVED follows if a retry succeeds
+        }
+        if (_saveFailures < SAVE_MAX_RETRIES)
+        {
+            _saveFailures++;
+        }
+        _stats.failedSaves++;
+        return false;
+    }
+    _saveFailures = 0;
+    if (_saveReportPending)
+    {
+        _saveReportPending = false;
+        updateStatusCharacteristic(STATUS_SAVED);
+    }
+    return true;
+}
+
+// Saves are coalesced, so STATUS_SAVED waits for the commit that contains them
+void PicoWiFiProvisioningClass::reportSaveWhenCommitted()
+{
+    if (!_dirty)
+    { // Nothing to write, the network is already on flash
+        updateStatusCharacteristic(STATUS_SAVED);
+        return;
+    }
+    _saveReportPending = true;
+    updateStatusCharacteristic(STATUS_SAVING);
+}
+
+bool PicoWiFiProvisioningClass::connectToStoredNetworks()
+{
+    if (_status == PROVISION_CONNECTING || _status == PROVISION_CONNECTED)
+    {
+        return false;
+    }
+    ensureNetworksLoaded();
+    if (_networkCount == 0)
+    {
+        return false;
+    }
+    memset(_triedNetworks, 0, sizeof(_triedNetworks));
+    return joinNextStoredNetwork();
+}
+
+// Highest priority enabled network not yet tried in this pass and not
+// quarantined, the earliest stored one on ties
+int PicoWiFiProvisioningClass::nextStoredNetwork()
+{
+    int best = -1;
+    for (int i = 0; i < _networkCount; i++)
+    {
+        if (!_networks[i].enabled || (_triedNetworks[i / 8] & (1 << (i % 8))))
+        {
+            continue;
+        }
+        if (isQuarantined(i))
+        {
+            Serial.print("Skipping quarantined network: ");
+            Serial.println(networkSSID(i));
+            continue;
+        }
+        if (best < 0 || _networks[i].priority > _networks[best].priority)
+        {
+            best = i;
+        }
+    }
+    return best;
+}
+
+bool PicoWiFiProvisioningClass::joinNextStoredNetwork()
+{
+    int best = nextStoredNetwork();
+    if (best < 0)
+    {
+        return false;
+    }
+    Serial.print("Attempting to connect to stored network (async): ");
+    Serial.println(networkSSID(best));
+    _triedNetworks[best / 8] |= 1 << (best % 8);
+    // A staged update is tried until it is promoted or rolled back
+    connectToNetwork(networkSSID(best), networkJoinPassword(best));
+    // Check if connectToNetwork initiated an attempt
+    _storedPass = _status == PROVISION_CONNECTING;
+    return _storedPass;
+}
+
+bool PicoWiFiProvisioningClass::isQuarantined(int index)
+{
+    expireQuarantines();
+    return _quarantineUntil[index] != 0;
+}
+
+// The longest penalty is well below the 9 hours that 16-bit seconds can
+// compare, and loop() clears each deadline shortly after it passes, so a
+// stale deadline never wraps back into the future. _strikes survive expiry
+// and keep doubling the next penalty until a join succeeds.
+void PicoWiFiProvisioningClass::expireQuarantines()
+{
+    uint16_t now = millis() / 1000;
+    for (int i = 0; i < MAX_WIFI_NETWORKS; i++)
+    {
+        if (_quarantineUntil[i] != 0 && (int16_t)(_quarantineUntil[i] - now) <= 0)
+        {
+            _quarantineUntil[i] = 0;
+        }
+    }
+}
+
+// Keep a failing network out of stored-network passes for a while. The
+// penalty depends on the failure reason and doubles with each consecutive
+// failure, up to QUARANTINE_MAX_DOUBLINGS times.
+void PicoWiFiProvisioningClass::quarantineNetwork(int index, PicoWiFiFailureReason reason)
+{
+    unsigned long penalty;
+    switch (reason)
+    {
+    case FAILURE_AUTH:
+        penalty = QUARANTINE_AUTH_MS;
+        break;
+    case FAILURE_DHCP_TIMEOUT:
+        penalty = QUARANTINE_DHCP_MS;
+        break;
+    case FAILURE_NO_SSID:
+    case FAILURE_ASSOC_TIMEOUT:
+    case FAILURE_ASSOC_FAILED:
+        penalty = QUARANTINE_UNREACHABLE_MS;
+        break;
+    default:
+        return;
+    }
+    penalty <<= min(_strikes[index], (uint8_t)QUARANTINE_MAX_DOUBLINGS);
+    if (_strikes[index] < UINT8_MAX)
+    {
+        _strikes[index]++;
+    }
+    _quarantineUntil[index] = (millis() + penalty) / 1000;
+    if (_quarantineUntil[index] == 0)
+    {
+        _quarantineUntil[index] = 1; // 0 means not quarantined, one second longer is harmless
+    }
+    _stats.quarantines++;
+    Serial.print("Quarantining ");
+    Serial.print(networkSSID(index));
+    Serial.print(" for ");
+    Serial.print(penalty / 1000);
+    Serial.println(" s");
+}
+
+void PicoWiFiProvisioningClass::clearQuarantine()
+{
+    memset(_strikes, 0, sizeof(_strikes));
+    memset(_quarantineUntil, 0, sizeof(_quarantineUntil));
+}
+
+void PicoWiFiProvisioningClass::connectToNetwork(const char *ssid, const char *password)
+{
+    requestJoin(ssid, password, true);
+}
+
+// Joins are restarted only when really needed: a request identical to the
+// join in flight (or the connected network) returns that join, a different
+// one either preempts it or waits in the one-deep queue where the latest wins.
+PicoWiFiJoinId PicoWiFiProvisioningClass::requestJoin(const char *ssid, const char *password, bool preempt)
+{
+    if (!ssid || strlen(ssid) == 0)
+    {
+        Serial.println("connectToNetwork: SSID is empty, connection attempt aborted.");
+        return 0;
+    }
+    if (!password)
+    {
+        password = "";
+    }
+    _storedPass = false; // A stored-network pass continues only from its own joins
+    bool joinActive = _activeJoin.id != 0 && (_status == PROVISION_CONNECTING || _status == PROVISION_CONNECTED);
+    if (joinActive && joinRequestMatches(_activeJoin, ssid, password))
+    {
+        Serial.println("Join request matches the current join, not restarting it");
+        _stats.dedupedJoins++;
+        return _activeJoin.id;
+    }
+    if (_queuedJoin.id != 0 && joinRequestMatches(_queuedJoin, ssid, password))
+    {
+        _stats.dedupedJoins++;
+        return _queuedJoin.id;
+    }
+
+    JoinRequest &request = (preempt || _status != PROVISION_CONNECTING) ? _activeJoin : _queuedJoin;
+    if (&request == &_activeJoin && _status == PROVISION_CONNECTING)
+    {
+        Serial.println("Join request preempts the join in flight");
+        _stats.supersededJoins++;
+    }
+    else if (&request == &_queuedJoin && _queuedJoin.id != 0)
+    {
+        Serial.println("Join request replaces the queued one");
+        _stats.supersededJoins++;
+    }
+    if (++_nextJoinId == 0)
+    {
+        _nextJoinId = 1; // 0 means no request
+    }
+    request.id = _nextJoinId;
+    strncpy(request.ssid, ssid, MAX_SSID_LENGTH);
+    request.ssid[MAX_SSID_LENGTH] = '\0';
+    strncpy(request.password, password, MAX_PASSWORD_LENGTH);
+    request.password[MAX_PASSWORD_LENGTH] = '\0';
+    if (&request == &_activeJoin)
+    {
+        startJoin(_activeJoin.ssid, _activeJoin.password);
+    }
+    else
+    {
+        Serial.print("Join queued until the current one ends: ");
+        Serial.println(ssid);
+    }
+    return request.id;
+}
+
+bool PicoWiFiProvisioningClass::cancelJoin(PicoWiFiJoinId id)
+{
+    if (id == 0)
+    {
+        return false;
+    }
+    if (id == _queuedJoin.id)
+    {
+        _queuedJoin.id = 0;
+        _stats.cancelledJoins++;
+        return true;
+    }
+    if (id == _activeJoin.id && _status == PROVISION_CONNECTING)
+    {
+        Serial.println("Join cancelled");
+        WiFi.disconnect();
+        _joiningIndex = -1; // Not a failure of the network
+        _joiningStaged = false;
+        _activeJoin.id = 0;
+        _failureReason = FAILURE_NONE;
+        completePendingSave(false);
+        setStatus(PROVISION_IDLE);
+        _stats.cancelledJoins++;
+        return true; // loop() starts the queued join, if any
+    }
+    return false;
+}
+
+bool PicoWiFiProvisioningClass::joinRequestMatches(const JoinRequest &request, const char *ssid, const char *password)
+{
+    return strncmp(request.ssid, ssid, MAX_SSID_LENGTH) == 0 &&
+           strncmp(request.password, password, MAX_PASSWORD_LENGTH) == 0;
+}
+
+void PicoWiFiProvisioningClass::startJoin(const char *ssid, const char *password)
+{
+    flush(); // Persist pending changes before the radio gets busy
+    _failureReason = FAILURE_NONE;
+    ensureNetworksLoaded(); // Stored settings (static IP, staged password) apply to explicit joins too
+    int stored = findNetwork(ssid);
+    _joiningStaged = stored >= 0 && _networks[stored].staged &&
+                     strcmp(password, networkStagedPassword(stored)) == 0;
+    // The outcome is charged to the stored entry only when the join uses its
+    // credentials, so a mistyped password cannot quarantine a working entry
+    _joiningIndex = (_joiningStaged || (stored >= 0 && strcmp(password, networkPassword(stored)) == 0)) ? stored : -1;
+    if (_pendingSave)
+    { // A new join supersedes the one validating pending credentials
+        _pendingSave = false;
+        _stats.rejectedSaves++;
+    }
+
+    if (_stats.joinStartMicros == 0)
+    {
+        _stats.joinStartMicros = micros();
+    }
+    setStatus(PROVISION_CONNECTING);
+    Serial.print("Attempting to connect to WiFi network (async): ");
+    Serial.println(ssid);
+
+    if (_bleStarted)
+    {
+        Serial.println("Stopping BLE advertising during WiFi connection");
+        BTstack.stopAdvertising();
+
+        if (_connectedDevice != nullptr)
+        {
+            Serial.println("Disconnecting BLE device before WiFi connection");
+            BTstack.bleDisconnect(_connectedDevice);
+            // Note: _connectedDevice cleared in handleDeviceDisconnected
+        }
+
+        Serial.println("Proceeding to WiFi operations after BLE shutdown pause.");
+    }
+
+    if (WiFi.status() != WL_DISCONNECTED && WiFi.status() != WL_IDLE_STATUS)
+    {
+        Serial.println("Disconnecting from current WiFi network first...");
+        WiFi.disconnect();
+        // No delay here, WiFi.begin() will override/manage.
+    }
+
+    applyIPConfig(stored);
+    WiFi.begin(ssid, password);
+    applyPowerMode(true); // Bringing the interface up resets the radio's power-save mode
+    _connectionStartTime = millis();
+}
+
+void PicoWiFiProvisioningClass::setLeaseCaching(bool enable)
+{
+    _leaseCaching = enable;
+}
+
+// Fixed settings only apply to stored networks; anything else goes back to
+// DHCP, but only if we changed the radio's config ourselves
+void PicoWiFiProvisioningClass::applyIPConfig(int index)
+{
+    const IPConfigSlot *slot = index >= 0 ? findIPConfig(index) : nullptr;
+    bool useStatic = slot && slot->mode == IP_CONFIG_STATIC;
+    bool useLease = slot && _leaseCaching && slot->mode == IP_CONFIG_CACHED_LEASE;
+    if (useStatic || useLease)
+    {
+        const WiFiIPConfig &ip = slot->ip;
+        Serial.print(useStatic ? "Using static IP: " : "Reusing cached lease: ");
+        Serial.println(IPAddress(ip.address));
+        WiFi.config(IPAddress(ip.address), IPAddress(ip.dns), IPAddress(ip.gateway), IPAddress(ip.subnet));
+        _staticIPApplied = true;
+        if (useLease)
+        {
+            _stats.cachedLeaseJoins++;
+        }
+    }
+    else if (_staticIPApplied)
+    {
+        WiFi.config(IPAddress(0, 0, 0, 0)); // Back to DHCP
+        _staticIPApplied = false;
+    }
+}
+
+// Written only when the lease differs from the cached one; static settings are kept
+void PicoWiFiProvisioningClass::cacheLease(int index)
+{
+    if (!_leaseCaching || index < 0 || index >= _networkCount)
+    {
+        return;
+    }
+    WiFiIPConfig lease;
+    lease.address = (uint32_t)WiFi.localIP();
+    lease.subnet = (uint32_t)WiFi.subnetMask();
+    lease.gateway = (uint32_t)WiFi.gatewayIP();
+    lease.dns = (uint32_t)WiFi.dnsIP();
+    const IPConfigSlot *slot = findIPConfig(index);
+    if (lease.address == 0 ||
+        (slot && (slot->mode == IP_CONFIG_STATIC || memcmp(&slot->ip, &lease, sizeof(lease)) == 0)))
+    {
+        return;
+    }
+    if (storeIPConfig(index, IP_CONFIG_CACHED_LEASE, lease))
+    {
+        markDirty();
+    }
+}
+
+bool PicoWiFiProvisioningClass::clearNetworks()
+{
+    unsigned long startTime = micros();
+    resetNetworks();
+    _joiningIndex = -1;
+    _networksLoaded = true; // Nothing left to load
+    _dirty = false;
+    _saveFailures = 0;
+    _saveReportPending = false;
+    if (ensureStorage())
+    {
+        _storage->erase();
+    }
+    _activeSlot = -1;
+    _stats.clearCount++;
+    _stats.lastClearMicros = micros() - startTime;
+    return true;
+}
+
+uint8_t PicoWiFiProvisioningClass::getNetworkCount()
+{
+    ensureNetworksLoaded();
+    return _networkCount;
+}
+
+PicoWiFiProvisioningStatus PicoWiFiProvisioningClass::getStatus()
+{
+    return _status;
+}
+
+// Set the current status and call the callback if registered
+void PicoWiFiProvisioningClass::setStatus(PicoWiFiProvisioningStatus newStatus)
+{
+    if (_status != newStatus)
+    {
+        // Serial.print(millis());                                                // DEBUG
+        // Serial.print("ms: PicoWiFiProvisioningClass::_status changing from "); // DEBUG
+        // Serial.print(_status);                                                 // DEBUG
+        // Serial.print(" to ");                                                  // DEBUG
+        // Serial.println(newStatus);                                             // DEBUG
+        _status = newStatus;
+        traceEvent(TRACE_PROVISION_STATUS, micros(), 0, newStatus);
+        applyPowerMode();
+        switch (newStatus)
+        {
+        case PROVISION_IDLE:
+            updateStatusCharacteristic(STATUS_IDLE);
+            break;
+        case PROVISION_CONNECTING:
+            updateStatusCharacteristic(STATUS_CONNECTING);
+            break;
+        case PROVISION_CONNECTED:
+            updateStatusCharacteristic(STATUS_CONNECTED);
+            break;
+        case PROVISION_FAILED:
+            updateStatusCharacteristic(STATUS_FAILED);
+            break;
+        default:
+            break;
+        }
+        if (_statusCallback)
+        {
+            _statusCallback(_status);
+        }
+    }
+    else
+    {
+        // Optional: Log if setStatus is called but status doesn't change
+        // Serial.print(millis()); // DEBUG
+        // Serial.print("ms: PicoWiFiProvisioningClass::setStatus called with same status: "); // DEBUG
+        // Serial.println(newStatus); // DEBUG
+    }
+}
+
+// --------------- ADDED MISSING DEFINITION ---------------
+// Set callback for status changes
+void PicoWiFiProvisioningClass::setStatusCallback(void (*callback)(PicoWiFiProvisioningStatus status))
+{
+    _statusCallback = callback;
+}
+// -------------------------------------------------------
+
+void PicoWiFiProvisioningClass::setWiFiStatusCallback(void (*callback)(wl_status_t status))
+{
+    _wifiStatusCallback = callback;
+}
+
+void PicoWiFiProvisioningClass::setBLEConnectionStateCallback(void (*callback)(bool isConnected))
+{
+    _bleConnectionStateCallback = callback;
+}
+
+void PicoWiFiProvisioningClass::setPasskeyDisplayCallback(void (*callback)(uint32_t passkey))
+{
+    BLESecure.setPasskeyDisplayCallback(callback);
+}
+
+void PicoWiFiProvisioningClass::setNumericComparisonCallback(void (*callback)(uint32_t passkey, BLEDevice *device))
+{
+    BLESecure.setNumericComparisonCallback(callback);
+}
+
+void PicoWiFiProvisioningClass::acceptNumericComparison(bool accept)
+{
+    BLESecure.acceptNumericComparison(accept);
+}
+
+void PicoWiFiProvisioningClass::setStorage(PicoWiFiProvisioningStorage *storage)
+{
+    _storage = storage ? storage : &defaultStorage;
+}
+
+void PicoWiFiProvisioningClass::allowProvisioningWhenConnected(bool allow)
+{
+    _allowProvisioningWhenConnected = allow;
+}
+
+void PicoWiFiProvisioningClass::setPowerMode(PicoWiFiPowerMode mode)
+{
+    _powerMode = mode;
+    applyPowerMode();
+}
+
+void PicoWiFiProvisioningClass::setTransferActive(bool active)
+{
+    _transferActive = active;
+    applyPowerMode();
+}
+
+// Joins and transfers want low latency; a connected but idle link can sleep
+// between beacons. Without an association the mode does not matter and the
+// core default is used.
+void PicoWiFiProvisioningClass::applyPowerMode(bool force)
+{
+    uint32_t pm;
+    switch (_powerMode)
+    {
+    case POWER_MODE_AUTO:
+        if (_status == PROVISION_CONNECTING || (_status == PROVISION_CONNECTED && _transferActive))
+        {
+            pm = CYW43_PERFORMANCE_PM;
+        }
+        else if (_status == PROVISION_CONNECTED)
+        {
+            pm = CYW43_AGGRESSIVE_PM;
+        }
+        else
+        {
+            pm = CYW43_DEFAULT_PM;
+        }
+        break;
+    case POWER_MODE_PERFORMANCE:
+        pm = CYW43_PERFORMANCE_PM;
+        break;
+    case POWER_MODE_DEFAULT:
+        pm = CYW43_DEFAULT_PM;
+        break;
+    case POWER_MODE_POWER_SAVE:
+        pm = CYW43_AGGRESSIVE_PM;
+        break;
+    default:
+        _appliedPm = 0;
+        return;
+    }
+    if (pm == _appliedPm && !force)
+    {
+        return;
+    }
+    if (cyw43_wifi_pm(&cyw43_state, pm) == 0)
+    {
+        if (pm != _appliedPm)
+        {
+            _stats.powerModeChanges++;
+        }
+        _appliedPm = pm;
+    }
+    else
+    {
+        Serial.println("Failed to set the WiFi power-save mode");
+    }
+}
+
+int32_t PicoWiFiProvisioningClass::getRSSI()
+{
+    return WiFi.RSSI();
+}
+
+const PicoWiFiProvisioningStats &PicoWiFiProvisioningClass::getStats()
+{
+    _stats.arenaBytesUsed = _arenaUsed;
+    return _stats;
+}
+
+void PicoWiFiProvisioningClass::resetStats()
+{
+    memset(&_stats, 0, sizeof(_stats));
+}
+
+void PicoWiFiProvisioningClass::setTraceCallback(void (*callback)(const PicoWiFiProvisioningTraceEvent *event))
+{
+    _traceCallback = callback;
+}
+
+void PicoWiFiProvisioningClass::printBootTimeline(Print &out)
+{
+    out.println("Boot timeline (us since reset, 0 = not reached):");
+    out.print("  WiFi join started:   ");
+    out.println(_stats.joinStartMicros);
+    out.print("  Networks loaded:     ");
+    out.println(_stats.credentialsReadyMicros);
+    out.print("  BLE service ready:   ");
+    out.println(_stats.bleReadyMicros);
+    out.print("  Advertising started: ");
+    out.println(_stats.advertisingStartMicros);
+    out.print("  WiFi connected:      ");
+    out.println(_stats.wifiConnectedMicros);
+}
+
+// Trace format, one event per line:
+// T,<timestampMicros>,<durationMicros>,<type>,<handle>,<value>,<length>,<payload hex | - if redacted>
+void PicoWiFiProvisioningClass::printTraceEvent(Print &out, const PicoWiFiProvisioningTraceEvent *event)
+{
+    out.print("T,");
+    out.print(event->timestampMicros);
+    out.print(',');
+    out.print(event->durationMicros);
+    out.print(',');
+    out.print((int)event->type);
+    out.print(',');
+    out.print(event->handle);
+    out.print(',');
+    out.print(event->value);
+    out.print(',');
+    out.print(event->length);
+    out.print(',');
+    if (event->data == nullptr && event->length > 0)
+    {
+        out.print('-');
+    }
+    for (uint16_t i = 0; event->data != nullptr && i < event->length; i++)
+    {
+        if (event->data[i] < 0x10)
+        {
+            out.print('0');
+        }
+        out.print(event->data[i], HEX);
+    }
+    out.println();
+}
+
+void PicoWiFiProvisioningClass::traceEvent(PicoWiFiProvisioningTraceType type, unsigned long startTime, uint16_t handle,
+                                           int32_t value, const uint8_t *data, uint16_t length)
+{
+    if (!_traceCallback)
+    {
+        return;
+    }
+    PicoWiFiProvisioningTraceEvent event;
+    event.timestampMicros = startTime;
+    event.durationMicros = micros() - startTime;
+    event.type = type;
+    event.handle = handle;
+    event.value = value;
+    event.data = data;
+    event.length = length;
+    _traceCallback(&event);
+}
+
+void PicoWiFiProvisioningClass::recordSessionMilestone()
+{
+    _stats.lastSessionRoundTrips = _sessionRoundTrips;
+    _stats.lastSessionMillis = millis() - _sessionStartTime;
+}
+
+// BTstack global callback Trampolines
+void bleDeviceConnected(BLEStatus status, BLEDevice *device)
 {
     PicoWiFiProvisioning.handleDeviceConnected(status, device);
 }
 
-void bleDeviceDisconnected(BLEDevice *device)
+void bleDeviceDisconnected(BLEDevice *device)
+{
+    PicoWiFiProvisioning.handleDeviceDisconnected(device);
+}
+
+int gattWriteCallback(uint16_t characteristic_id, uint8_t *buffer, uint16_t buffer_size)
+{
+    return PicoWiFiProvisioning.handleGattWrite(characteristic_id, buffer, buffer_size);
+}
+
+uint16_t gattReadCallback(uint16_t characteristic_id, uint8_t *buffer, uint16_t buffer_size)
+{
+    return PicoWiFiProvisioning.handleGattRead(characteristic_id, buffer, buffer_size);
+}
+
+// Class member implementations for BLE events
+void PicoWiFiProvisioningClass::handleDeviceConnected(BLEStatus status, BLEDevice *device)
+{
+    unsigned long startTime = micros();
+    if (status == BLE_STATUS_OK)
+    {
+        Serial.println("BLE Device connected");
+        _connectedDevice = device;
+        _stats.bleSessions++;
+        _sessionStartTime = millis();
+        _sessionRoundTrips = 0;
+        if (_bleConnectionStateCallback)
+        {
+            _bleConnectionStateCallback(true);
+        }
+        if (_status == PROVISION_CONNECTED && !_allowProvisioningWhenConnected)
+        {
+            Serial.println("Already connected to WiFi. Further BLE provisioning may be restricted.");
+        }
+    }
+    else
+    {
+        Serial.print("BLE Connection attempt failed or ended with status: ");
+        Serial.println(status);
+        _connectedDevice = nullptr;
+        if (_bleConnectionStateCallback)
+        {
+            _bleConnectionStateCallback(false);
+        }
+    }
+    traceEvent(TRACE_BLE_CONNECTED, startTime, 0, status);
+}
+
+void PicoWiFiProvisioningClass::handleDeviceDisconnected(BLEDevice *device)
+{
+    unsigned long startTime = micros();
+    Serial.println("BLE Device disconnected");
+    updatePairingStatusCharacteristic(false); // Pairing is lost/invalid on disconnect
+    _connectedDevice = nullptr;
+    BLENotify.handleDisconnection();
+    if (_bleConnectionStateCallback)
+    {
+        _bleConnectionStateCallback(false);
+    }
+    traceEvent(TRACE_BLE_DISCONNECTED, startTime, 0, 0);
+}
+
+int PicoWiFiProvisioningClass::handleGattWrite(uint16_t characteristic_id, uint8_t *buffer, uint16_t buffer_size)
+{
+    unsigned long startTime = micros();
+    _stats.gattWrites++;
+    _stats.gattBytesIn += buffer_size;
+    _sessionRoundTrips++;
+
+    if (characteristic_id == _ssidCharHandle)
+    {
+        memset(_receivedSSID, 0, sizeof(_receivedSSID));
+        size_t copyLen = min((size_t)buffer_size, (size_t)MAX_SSID_LENGTH);
+        memcpy(_receivedSSID, buffer, copyLen);
+        Serial.print("Received SSID: ");
+        Serial.println(_receivedSSID);
+    }
+    else if (characteristic_id == _passwordCharHandle)
+    {
+        memset(_receivedPassword, 0, sizeof(_receivedPassword));
+        size_t copyLen = min((size_t)buffer_size, (size_t)MAX_PASSWORD_LENGTH);
+        memcpy(_receivedPassword, buffer, copyLen);
+        Serial.println("Received password");
+    }
+    else if (characteristic_id == _commandCharHandle && buffer_size >= 1)
+    {
+        uint8_t command = buffer[0];
+        processCommand(command, buffer + 1, buffer_size - 1);
+    }
+
+    // Handle CCCD writes for notifications
+    if (buffer_size == 2)
+    { // CCCD is 2 bytes
+        // The characteristic_id in gattWriteCallback for a CCCD write is the handle of the CCCD itself.
+        // The characteristic's value handle is usually CCCD_handle - 1.
+        uint16_t char_value_handle = characteristic_id - 1;
+        uint16_t cccd_value = (buffer[1] << 8) | buffer[0];
+
+        if (char_value_handle == _pairingStatusCharHandle)
+        { // Check if this CCCD belongs to pairingStatusChar
+            if (cccd_value == 0x0001)
+            { // Notifications enabled
+                BLENotify.handleSubscriptionChange(_pairingStatusCharHandle, true);
+                Serial.println("Pairing status notifications enabled by client");
+                bool isPaired = (_connectedDevice && BLESecure.getPairingStatus() == PAIRING_COMPLETE);
+                updatePairingStatusCharacteristic(isPaired); // Send current status
+            }
+            else if (cccd_value == 0x0000)
+            { // Notifications disabled
+                BLENotify.handleSubscriptionChange(_pairingStatusCharHandle, false);
+                Serial.println("Pairing status notifications disabled by client");
+            }
+        }
+        else if (char_value_handle == _statusCharHandle)
+        {
+            if (cccd_value == 0x0001)
+            {
+                BLENotify.handleSubscriptionChange(_statusCharHandle, true);
+                Serial.println("Status notifications enabled by client");
+                updateStatusCharacteristic(_statusCode); // Send current status
+            }
+            else if (cccd_value == 0x0000)
+            {
+                BLENotify.handleSubscriptionChange(_statusCharHandle, false);
+                Serial.println("Status notifications disabled by client");
+            }
+        }
+        // Add similar blocks for other characteristics if they have CCCDs and need handling
+    }
+
+    // Never put the password into a trace, only its length
+    const uint8_t *traceData = (characteristic_id == _passwordCharHandle) ? nullptr : buffer;
+    traceEvent(TRACE_GATT_WRITE, startTime, characteristic_id, 0, traceData, buffer_size);
+    return 0;
+}
+
+uint16_t PicoWiFiProvisioningClass::handleGattRead(uint16_t characteristic_id, uint8_t *buffer, uint16_t buffer_size)
+{
+    unsigned long startTime = micros();
+    uint16_t len = readCharacteristic(characteristic_id, buffer, buffer_size);
+    if (buffer != NULL)
+    { // Length-only queries are not traced
+        traceEvent(TRACE_GATT_READ, startTime, characteristic_id, len, buffer, len);
+    }
+    return len;
+}
+
+uint16_t PicoWiFiProvisioningClass::readCharacteristic(uint16_t characteristic_id, uint8_t *buffer, uint16_t buffer_size)
+{
+    if (characteristic_id == _ssidCharHandle)
+    {
+        // Provide the value of the _receivedSSID.
+        // This reflects the SSID last written by the client during provisioning.
+        size_t len = strlen(_receivedSSID);
+
+        if (buffer == NULL)
+        { // Client is asking for the length only
+            return len;
+        }
+
+        if (buffer_size < len)
+        {
+            // Provided buffer is too small.
+            // You might want to log an error or handle it differently.
+            // For now, returning 0, which is an error for ATT reads.
+            Serial.println("Error: Buffer too small for SSID read.");
+            return 0;
+        }
+
+        memcpy(buffer, _receivedSSID, len);
+        _stats.gattReads++;
+        _stats.gattBytesOut += len;
+        _sessionRoundTrips++;
+        // Serial.print("Read SSID: "); Serial.println(_receivedSSID); // Optional: for debugging
+        return len;
+    }
+    else if (characteristic_id == _pairingStatusCharHandle)
+    {
+        // Provide the current pairing status. Uses enum PairingStatusCodes from .h
+        uint8_t pairingStatusValue = PAIRING_STATUS_NOT_PAIRED; // Default to not paired
+
+        // Check current pairing status with the connected device
+        if (_connectedDevice && BLESecure.getPairingStatus() == PAIRING_COMPLETE)
+        {
+            pairingStatusValue = PAIRING_STATUS_PAIRED; //
+        }
+
+        if (buffer == NULL)
+        { // Client is asking for the length only
+            return sizeof(pairingStatusValue);
+        }
+
+        if (buffer_size < sizeof(pairingStatusValue))
+        {
+            Serial.println("Error: Buffer too small for Pairing Status read.");
+            return 0;
+        }
+
+        buffer[0] = pairingStatusValue;
+        _stats.gattReads++;
+        _stats.gattBytesOut += sizeof(pairingStatusValue);
+        _sessionRoundTrips++;
+        // Serial.print("Read Pairing Status: "); Serial.println(pairingStatusValue); // Optional: for debugging
+        return sizeof(pairingStatusValue);
+    }
+
+    else if (characteristic_id == _statusCharHandle)
+    {
+        if (buffer == NULL)
+        {
+            return 2;
+        }
+        if (buffer_size < 2)
+        {
+            Serial.println("Error: Buffer too small for Status read.");
+            return 0;
+        }
+        buffer[0] = _statusCode;
+        buffer[1] = _failureReason;
+        _stats.gattReads++;
+        _stats.gattBytesOut += 2;
+        _sessionRoundTrips++;
+        return 2;
+    }
+
+    // If the characteristic_id is not handled by this function, return 0.
+    // This indicates to the stack that this callback did not provide data for this handle.
+    return 0;
+}
+
+#if PICO_WIFI_PROVISIONING_LEGACY_JSON
+// Buffered reader over the config file for the streaming JSON parser.
+// Reads through a fixed buffer so parsing never allocates.
+struct ConfigStream
+{
+    File *file;
+    uint8_t buffer[64];
+    size_t length;
+    size_t position;
+};
+
+static int streamPeek(ConfigStream &stream)
+{
+    if (stream.position >= stream.length)
+    {
+        stream.length = stream.file->read(stream.buffer, sizeof(stream.buffer));
+        stream.position = 0;
+        if (stream.length == 0)
+        {
+            return -1;
+        }
+    }
+    return stream.buffer[stream.position];
+}
+
+static int streamNext(ConfigStream &stream)
+{
+    int c = streamPeek(stream);
+    if (c >= 0)
+    {
+        stream.position++;
+    }
+    return c;
+}
+
+static int streamNextToken(ConfigStream &stream)
+{
+    int c = streamNext(stream);
+    while (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+    {
+        c = streamNext(stream);
+    }
+    return c;
+}
+
+// Append a code point as UTF-8, dropping bytes beyond capacity
+static void appendUtf8(char *dest, size_t capacity, size_t &length, uint32_t codePoint)
+{
+    uint8_t bytes[4];
+    size_t count;
+    if (codePoint < 0x80)
+    {
+        bytes[0] = codePoint;
+        count = 1;
+    }
+    else if (codePoint < 0x800)
+    {
+        bytes[0] = 0xC0 | (codePoint >> 6);
+        bytes[1] = 0x80 | (codePoint & 0x3F);
+        count = 2;
+    }
+    else if (codePoint < 0x10000)
+    {
+        bytes[0] = 0xE0 | (codePoint >> 12);
+        bytes[1] = 0x80 | ((codePoint >> 6) & 0x3F);
+        bytes[2] = 0x80 | (codePoint & 0x3F);
+        count = 3;
+    }
+    else
+    {
+        bytes[0] = 0xF0 | (codePoint >> 18);
+        bytes[1] = 0x80 | ((codePoint >> 12) & 0x3F);
+        bytes[2] = 0x80 | ((codePoint >> 6) & 0x3F);
+        bytes[3] = 0x80 | (codePoint & 0x3F);
+        count = 4;
+    }
+    for (size_t i = 0; i < count; i++, length++)
+    {
+        if (dest && length < capacity)
+        {
+            dest[length] = bytes[i];
+        }
+    }
+}
+
+static bool readHex4(ConfigStream &stream, uint32_t &value)
+{
+    value = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        int c = streamNext(stream);
+        value <<= 4;
+        if (c >= '0' && c <= '9')
+            value |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            value |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            value |= c - 'A' + 10;
+        else
+            return false;
+    }
+    return true;
+}
+
+// Decode a JSON string whose opening quote was already consumed.
+// Writes at most capacity bytes plus a terminator into dest (dest may be nullptr to skip).
+// Returns the full decoded length, or -1 on malformed input.
+static int readString(ConfigStream &stream, char *dest, size_t capacity)
+{
+    size_t length = 0;
+    while (true)
+    {
+        int c = streamNext(stream);
+        if (c < 0)
+        {
+            return -1;
+        }
+        if (c == '"')
+        {
+            break;
+        }
+        if (c == '\\')
+        {
+            c = streamNext(stream);
+            switch (c)
+            {
+            case '"':
+            case '\\':
+            case '/':
+                break;
+            case 'b':
+                c = '\b';
+                break;
+            case 'f':
+                c = '\f';
+                break;
+            case 'n':
+                c = '\n';
+                break;
+            case 'r':
+                c = '\r';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case 'u':
+            {
+                uint32_t codePoint;
+                if (!readHex4(stream, codePoint))
+                {
+                    return -1;
+                }
+                if (codePoint >= 0xD800 && codePoint < 0xDC00)
+                { // High surrogate, expect the low half to follow
+                    uint32_t low;
+                    if (streamNext(stream) != '\\' || streamNext(stream) != 'u' || !readHex4(stream, low) ||
+                        low < 0xDC00 || low > 0xDFFF)
+                    {
+                        return -1;
+                    }
+                    codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (low - 0xDC00);
+                }
+                appendUtf8(dest, capacity, length, codePoint);
+                continue;
+            }
+            default:
+                return -1;
+            }
+        }
+        if (dest && length < capacity)
+        {
+            dest[length] = c;
+        }
+        length++;
+    }
+    if (dest)
+    {
+        dest[min(length, capacity)] = '\0';
+    }
+    return length;
+}
+
+// Skip a JSON value whose first character was already consumed
+static bool skipValue(ConfigStream &stream, int first)
+{
+    if (first == '"')
+    {
+        return readString(stream, nullptr, 0) >= 0;
+    }
+    if (first != '{' && first != '[')
+    {
+        // Number or literal: consume until a delimiter
+        while (true)
+        {
+            int c = streamPeek(stream);
+            if (c < 0 || c == ',' || c == '}' || c == ']' || c == ' ' || c == '\t' || c == '\r' || c == '\n')
+            {
+                return true;
+            }
+            streamNext(stream);
+        }
+    }
+    int depth = 1;
+    while (depth > 0)
+    {
+        int c = streamNext(stream);
+        if (c < 0)
+        {
+            return false;
+        }
+        if (c == '"')
+        {
+            if (readString(stream, nullptr, 0) < 0)
+            {
+                return false;
+            }
+        }
+        else if (c == '{' || c == '[')
+        {
+            depth++;
+        }
+        else if (c == '}' || c == ']')
+        {
+            depth--;
+        }
+    }
+    return true;
+}
+
+// Read a literal into a small buffer, used for true/false
+static void readLiteral(ConfigStream &stream, int first, char *dest, size_t capacity)
+{
+    size_t length = 0;
+    dest[length++] = first;
+    while (true)
+    {
+        int c = streamPeek(stream);
+        if (c < 'a' || c > 'z')
+        {
+            break;
+        }
+        if (length < capacity - 1)
+        {
+            dest[length++] = c;
+        }
+        streamNext(stream);
+    }
+    dest[length] = '\0';
+}
+
+// Parse one {"ssid": ..., "password": ..., "enabled": ...} object into the
+// given buffers (nullptr to skip). The opening brace was already consumed.
+static bool parseNetworkObject(ConfigStream &stream, char *ssid, char *password, bool *enabled)
+{
+    int c = streamNextToken(stream);
+    if (c == '}')
+    {
+        return true;
+    }
+    while (true)
+    {
+        char key[10];
+        if (c != '"')
+        {
+            return false;
+        }
+        int keyLength = readString(stream, key, sizeof(key) - 1);
+        if (keyLength < 0 || streamNextToken(stream) != ':')
+        {
+            return false;
+        }
+        bool knownKey = (size_t)keyLength < sizeof(key) - 1;
+        c = streamNextToken(stream);
+        if (ssid && knownKey && strcmp(key, "ssid") == 0 && c == '"')
+        {
+            if (readString(stream, ssid, MAX_SSID_LENGTH) < 0)
+                return false;
+        }
+        else if (ssid && knownKey && strcmp(key, "password") == 0 && c == '"')
+        {
+            if (readString(stream, password, MAX_PASSWORD_LENGTH) < 0)
+                return false;
+        }
+        else if (ssid && knownKey && strcmp(key, "enabled") == 0 && (c == 't' || c == 'f'))
+        {
+            char literal[6];
+            readLiteral(stream, c, literal, sizeof(literal));
+            *enabled = strcmp(literal, "false") != 0; // Default to true unless explicitly false
+        }
+        else if (!skipValue(stream, c))
+        {
+            return false;
+        }
+        c = streamNextToken(stream);
+        if (c == '}')
+        {
+            return true;
+        }
+        if (c != ',')
+        {
+            return false;
+        }
+        c = streamNextToken(stream);
+    }
+}
+
+// Stream the legacy {"networks": [...]} config into the network table without building a document
+bool PicoWiFiProvisioningClass::parseNetworksJson(File &configFile)
+{
+    ConfigStream stream;
+    stream.file = &configFile;
+    stream.length = 0;
+    stream.position = 0;
+
+    if (streamNextToken(stream) != '{')
+    {
+        return false;
+    }
+    int c = streamNextToken(stream);
+    while (c != '}')
+    {
+        char key[10];
+        if (c != '"')
+        {
+            return false;
+        }
+        int keyLength = readString(stream, key, sizeof(key) - 1);
+        if (keyLength < 0 || streamNextToken(stream) != ':')
+        {
+            return false;
+        }
+        c = streamNextToken(stream);
+        if ((size_t)keyLength < sizeof(key) - 1 && strcmp(key, "networks") == 0 && c == '[')
+        {
+            c = streamNextToken(stream);
+            while (c != ']')
+            {
+                if (c == '{')
+                {
+                    char ssid[MAX_SSID_LENGTH + 1] = "";
+                    char password[MAX_PASSWORD_LENGTH + 1] = "";
+                    bool enabled = true; // Default to true if missing
+                    bool full = _networkCount >= MAX_WIFI_NETWORKS;
+                    if (!parseNetworkObject(stream, full ? nullptr : ssid, password, &enabled))
+                    {
+                        return false;
+                    }
+                    if (strlen(ssid) > 0)
+                    {
+                        int index = addNetwork(ssid, strlen(ssid), password, strlen(password));
+                        if (index >= 0)
+                        {
+                            _networks[index].enabled = enabled;
+                        }
+                    }
+                }
+                else if (!skipValue(stream, c))
+                {
+                    return false;
+                }
+                c = streamNextToken(stream);
+                if (c == ',')
+                {
+                    c = streamNextToken(stream);
+                }
+                else if (c != ']')
+                {
+                    return false;
+                }
+            }
+        }
+        else if (!skipValue(stream, c))
+        {
+            return false;
+        }
+        c = streamNextToken(stream);
+        if (c == ',')
+        {
+            c = streamNextToken(stream);
+        }
+        else if (c != '}')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+#endif // PICO_WIFI_PROVISIONING_LEGACY_JSON
+
+// CRC-32 (IEEE 802.3) over the image payload
+static uint32_t crc32(const uint8_t *data, size_t length)
 {
-    PicoWiFiProvisioning.handleDeviceDisconnected(device);
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < length; i++)
+    {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
 }
 
-int gattWriteCallback(uint16_t characteristic_id, uint8_t *buffer, uint16_t buffer_size)
+static void writeLE16(uint8_t *dest, uint16_t value)
 {
-    return PicoWiFiProvisioning.handleGattWrite(characteristic_id, buffer, buffer_size);
+    dest[0] = value & 0xFF;
+    dest[1] = value >> 8;
 }
 
-uint16_t gattReadCallback(uint16_t characteristic_id, uint8_t *buffer, uint16_t buffer_size)
+static void writeLE32(uint8_t *dest, uint32_t value)
 {
-    return PicoWiFiProvisioning.handleGattRead(characteristic_id, buffer, buffer_size);
+    for (int i = 0; i < 4; i++)
+    {
+        dest[i] = (value >> (8 * i)) & 0xFF;
+    }
 }
 
-// Class member implementations for BLE events
-void PicoWiFiProvisioningClass::handleDeviceConnected(BLEStatus status, BLEDevice *device)
+static uint16_t readLE16(const uint8_t *src)
 {
-    if (status == BLE_STATUS_OK)
+    return src[0] | (src[1] << 8);
+}
+
+static uint32_t readLE32(const uint8_t *src)
+{
+    return src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t)src[3] << 24);
+}
+
+static size_t appendField(uint8_t *dest, uint8_t tag, const void *value, uint8_t length)
+{
+    dest[0] = tag;
+    dest[1] = length;
+    memcpy(dest + 2, value, length);
+    return 2 + length;
+}
+
+// Encode the networks array into a config image, returns the image size
+size_t PicoWiFiProvisioningClass::encodeNetworks(uint8_t *image, size_t capacity, uint32_t sequence)
+{
+    if (capacity < (size_t)(WIFI_CONFIG_HEADER_SIZE + _networkCount * WIFI_CONFIG_ENTRY_OVERHEAD +
+                            WIFI_IP_CONFIG_SLOTS * WIFI_CONFIG_IP_FIELD_SIZE + _arenaUsed))
     {
-        Serial.println("BLE Device connected");
-        _connectedDevice = device;
-        if (_bleConnectionStateCallback)
+        return 0;
+    }
+    uint8_t *payload = image + WIFI_CONFIG_HEADER_SIZE;
+    size_t length = 0;
+    for (int i = 0; i < _networkCount; i++)
+    {
+        uint8_t flags = _networks[i].enabled ? NET_FLAG_ENABLED : 0;
+        if (i == _lastConnectedIndex)
         {
-            _bleConnectionStateCallback(true);
+            flags |= NET_FLAG_LAST_CONNECTED;
         }
-        if (_status == PROVISION_CONNECTED && !_allowProvisioningWhenConnected)
+        length += appendField(payload + length, NET_FIELD_SSID, networkSSID(i), _networks[i].ssidLength);
+        length += appendField(payload + length, NET_FIELD_PASSWORD, networkPassword(i), _networks[i].passwordLength);
+        length += appendField(payload + length, NET_FIELD_FLAGS, &flags, 1);
+        uint8_t usage[8];
+        writeLE32(usage, _networks[i].lastUsed);
+        writeLE16(usage + 4, _networks[i].successCount);
+        writeLE16(usage + 6, _networks[i].failureCount);
+        length += appendField(payload + length, NET_FIELD_USAGE, usage, sizeof(usage));
+        if (_networks[i].priority > 0)
         {
-            Serial.println("Already connected to WiFi. Further BLE provisioning may be restricted.");
+            length += appendField(payload + length, NET_FIELD_PRIORITY, &_networks[i].priority, 1);
         }
-    }
-    else
-    {
-        Serial.print("BLE Connection attempt failed or ended with status: ");
-        Serial.println(status);
-        _connectedDevice = nullptr;
-        if (_bleConnectionStateCallback)
+        if (_networks[i].staged)
         {
-            _bleConnectionStateCallback(false);
+            payload[length] = NET_FIELD_STAGED;
+            payload[length + 1] = 2 + _networks[i].stagedLength;
+            payload[length + 2] = _networks[i].stagedConfirmations;
+            payload[length + 3] = _networks[i].stagedFailures;
+            memcpy(payload + length + 4, networkStagedPassword(i), _networks[i].stagedLength);
+            length += 4 + _networks[i].stagedLength;
+        }
+        const IPConfigSlot *slot = findIPConfig(i);
+        if (slot)
+        {
+            uint8_t ip[17];
+            ip[0] = slot->mode;
+            writeLE32(ip + 1, slot->ip.address);
+            writeLE32(ip + 5, slot->ip.subnet);
+            writeLE32(ip + 9, slot->ip.gateway);
+            writeLE32(ip + 13, slot->ip.dns);
+            length += appendField(payload + length, NET_FIELD_IP, ip, sizeof(ip));
         }
+        payload[length++] = NET_FIELD_END;
     }
+    writeLE32(image, CONFIG_IMAGE_MAGIC);
+    image[4] = CONFIG_IMAGE_VERSION;
+    image[5] = _networkCount;
+    writeLE16(image + 6, length);
+    writeLE32(image + 8, crc32(payload, length));
+    writeLE32(image + 12, sequence);
+    return WIFI_CONFIG_HEADER_SIZE + length;
 }
 
-void PicoWiFiProvisioningClass::handleDeviceDisconnected(BLEDevice *device)
+// Check the fixed part of a config image header and return its size and sequence number
+static bool parseConfigHeader(const uint8_t *image, size_t size, size_t &headerSize, uint32_t &sequence)
 {
-    Serial.println("BLE Device disconnected");
-    updatePairingStatusCharacteristic(false); // Pairing is lost/invalid on disconnect
-    _connectedDevice = nullptr;
-    BLENotify.handleDisconnection();
-    if (_bleConnectionStateCallback)
+    if (size < CONFIG_HEADER_V1_SIZE || readLE32(image) != CONFIG_IMAGE_MAGIC)
     {
-        _bleConnectionStateCallback(false);
+        return false;
+    }
+    if (image[4] == 1)
+    {
+        headerSize = CONFIG_HEADER_V1_SIZE;
+        sequence = 0;
+        return true;
+    }
+    if (image[4] == CONFIG_IMAGE_VERSION && size >= WIFI_CONFIG_HEADER_SIZE)
+    {
+        headerSize = WIFI_CONFIG_HEADER_SIZE;
+        sequence = readLE32(image + 12);
+        return true;
     }
+    return false;
 }
 
-int PicoWiFiProvisioningClass::handleGattWrite(uint16_t characteristic_id, uint8_t *buffer, uint16_t buffer_size)
+// Validate a config image and decode it into the networks array
+bool PicoWiFiProvisioningClass::decodeNetworks(const uint8_t *image, size_t size)
 {
-    if (characteristic_id == _ssidCharHandle)
-    {
-        memset(_receivedSSID, 0, sizeof(_receivedSSID));
-        size_t copyLen = min((size_t)buffer_size, (size_t)MAX_SSID_LENGTH);
-        memcpy(_receivedSSID, buffer, copyLen);
-        Serial.print("Received SSID: ");
-        Serial.println(_receivedSSID);
-    }
-    else if (characteristic_id == _passwordCharHandle)
+    size_t headerSize;
+    uint32_t sequence;
+    if (!parseConfigHeader(image, size, headerSize, sequence))
     {
-        memset(_receivedPassword, 0, sizeof(_receivedPassword));
-        size_t copyLen = min((size_t)buffer_size, (size_t)MAX_PASSWORD_LENGTH);
-        memcpy(_receivedPassword, buffer, copyLen);
-        Serial.println("Received password");
+        return false;
     }
-    else if (characteristic_id == _commandCharHandle && buffer_size >= 1)
+    uint8_t count = image[5];
+    size_t length = readLE16(image + 6);
+    const uint8_t *payload = image + headerSize;
+    if (headerSize + length > size || crc32(payload, length) != readLE32(image + 8))
     {
-        uint8_t command = buffer[0];
-        processCommand(command);
+        return false;
     }
 
-    // Handle CCCD writes for notifications
-    if (buffer_size == 2)
-    { // CCCD is 2 bytes
-        // The characteristic_id in gattWriteCallback for a CCCD write is the handle of the CCCD itself.
-        // The characteristic's value handle is usually CCCD_handle - 1.
-        uint16_t char_value_handle = characteristic_id - 1;
-        uint16_t cccd_value = (buffer[1] << 8) | buffer[0];
-
-        if (char_value_handle == _pairingStatusCharHandle)
-        { // Check if this CCCD belongs to pairingStatusChar
-            if (cccd_value == 0x0001)
-            { // Notifications enabled
-                BLENotify.handleSubscriptionChange(_pairingStatusCharHandle, true);
-                Serial.println("Pairing status notifications enabled by client");
-                bool isPaired = (_connectedDevice && BLESecure.getPairingStatus() == PAIRING_COMPLETE);
-                updatePairingStatusCharacteristic(isPaired); // Send current status
+    resetNetworks();
+    size_t pos = 0;
+    for (int i = 0; i < count; i++)
+    {
+        // Strings are copied into the arena once the whole entry is read
+        WiFiNetworkConfig network;
+        memset(&network, 0, sizeof(network));
+        const uint8_t *ssid = nullptr;
+        const uint8_t *password = nullptr;
+        const uint8_t *staged = nullptr;
+        uint8_t ssidLength = 0;
+        uint8_t passwordLength = 0;
+        uint8_t stagedLength = 0;
+        bool lastConnected = false;
+        uint8_t ipMode = IP_CONFIG_DHCP;
+        WiFiIPConfig ip;
+        memset(&ip, 0, sizeof(ip));
+        while (true)
+        {
+            if (pos >= length)
+            {
+                return false;
             }
-            else if (cccd_value == 0x0000)
-            { // Notifications disabled
-                BLENotify.handleSubscriptionChange(_pairingStatusCharHandle, false);
-                Serial.println("Pairing status notifications disabled by client");
+            uint8_t tag = payload[pos++];
+            if (tag == NET_FIELD_END)
+            {
+                break;
+            }
+            if (pos >= length || pos + 1 + payload[pos] > length)
+            {
+                return false;
+            }
+            uint8_t fieldLength = payload[pos++];
+            const uint8_t *value = payload + pos;
+            pos += fieldLength;
+            switch (tag)
+            {
+            case NET_FIELD_SSID:
+                ssid = value;
+                ssidLength = fieldLength;
+                break;
+            case NET_FIELD_PASSWORD:
+                password = value;
+                passwordLength = fieldLength;
+                break;
+            case NET_FIELD_FLAGS:
+                network.enabled = fieldLength > 0 && (value[0] & NET_FLAG_ENABLED);
+                lastConnected = fieldLength > 0 && (value[0] & NET_FLAG_LAST_CONNECTED);
+                break;
+            case NET_FIELD_USAGE:
+                if (fieldLength >= 8)
+                {
+                    network.lastUsed = readLE32(value);
+                    network.successCount = readLE16(value + 4);
+                    network.failureCount = readLE16(value + 6);
+                    _useClock = max(_useClock, network.lastUsed);
+                }
+                break;
+            case NET_FIELD_PRIORITY:
+                network.priority = fieldLength > 0 ? value[0] : 0;
+                break;
+            case NET_FIELD_STAGED:
+                if (fieldLength >= 2)
+                {
+                    network.stagedConfirmations = max(value[0], (uint8_t)1); // 0 would wrap on the next decrement
+                    network.stagedFailures = max(value[1], (uint8_t)1);
+                    staged = value + 2;
+                    stagedLength = fieldLength - 2;
+                }
+                break;
+            case NET_FIELD_IP:
+                if (fieldLength >= 17)
+                {
+                    ipMode = value[0];
+                    ip.address = readLE32(value + 1);
+                    ip.subnet = readLE32(value + 5);
+                    ip.gateway = readLE32(value + 9);
+                    ip.dns = readLE32(value + 13);
+                }
+                break;
+            default:
+                break; // Field from a newer version, skip it
+            }
+        }
+        if (ssidLength == 0)
+        {
+            continue;
+        }
+        int index = addNetwork((const char *)ssid, ssidLength, (const char *)password, passwordLength);
+        if (index >= 0)
+        {
+            // Keep the arena placement, take everything else from the entry
+            network.ssidOffset = _networks[index].ssidOffset;
+            network.ssidLength = _networks[index].ssidLength;
+            network.passwordLength = _networks[index].passwordLength;
+            _networks[index] = network;
+            if (lastConnected)
+            {
+                _lastConnectedIndex = index;
+            }
+            if (ipMode == IP_CONFIG_CACHED_LEASE || ipMode == IP_CONFIG_STATIC)
+            {
+                storeIPConfig(index, ipMode, ip);
+            }
+            if (!staged || !setNetworkStrings(index, networkPassword(index), passwordLength,
+                                              (const char *)staged, stagedLength))
+            {
+                _networks[index].stagedConfirmations = 0;
+                _networks[index].stagedFailures = 0;
             }
         }
-        // Add similar blocks for other characteristics if they have CCCDs and need handling
     }
-    return 0;
+    return true;
 }
 
-uint16_t PicoWiFiProvisioningClass::handleGattRead(uint16_t characteristic_id, uint8_t *buffer, uint16_t buffer_size)
+const uint8_t *PicoWiFiProvisioningClass::readSlotImage(uint8_t slot, size_t &size)
 {
-    if (characteristic_id == _ssidCharHandle)
-    {
-        // Provide the value of the _receivedSSID.
-        // This reflects the SSID last written by the client during provisioning.
-        size_t len = strlen(_receivedSSID);
+    const uint8_t *image = _storage->map(slot, size);
+    if (!image)
+    { // Not memory-mapped, copy it into the scratch buffer
+        size = _storage->read(slot, 0, configImage, sizeof(configImage));
+        image = configImage;
+    }
+    return image;
+}
 
-        if (buffer == NULL)
-        { // Client is asking for the length only
-            return len;
+// Pick the newest slot by reading one header per slot, then fall back to the
+// other slot if the newest one fails its CRC
+bool PicoWiFiProvisioningClass::loadNetworksFromFlash()
+{
+    unsigned long startTime = micros();
+    uint8_t slots = min(_storage->slotCount(), (uint8_t)2);
+    bool valid[2] = {false, false};
+    uint32_t sequence[2] = {0, 0};
+    bool anyStored = false;
+    for (uint8_t slot = 0; slot < slots; slot++)
+    {
+        uint8_t header[WIFI_CONFIG_HEADER_SIZE];
+        size_t size;
+        const uint8_t *mapped = _storage->map(slot, size);
+        if (mapped)
+        {
+            size = min(size, sizeof(header));
+            memcpy(header, mapped, size);
         }
-
-        if (buffer_size < len)
+        else
         {
-            // Provided buffer is too small.
-            // You might want to log an error or handle it differently.
-            // For now, returning 0, which is an error for ATT reads.
-            Serial.println("Error: Buffer too small for SSID read.");
-            return 0;
+            size = _storage->read(slot, 0, header, sizeof(header));
         }
-
-        memcpy(buffer, _receivedSSID, len);
-        // Serial.print("Read SSID: "); Serial.println(_receivedSSID); // Optional: for debugging
-        return len;
+        size_t headerSize;
+        anyStored |= size > 0;
+        valid[slot] = parseConfigHeader(header, size, headerSize, sequence[slot]);
     }
-    else if (characteristic_id == _pairingStatusCharHandle)
-    {
-        // Provide the current pairing status. Uses enum PairingStatusCodes from .h
-        uint8_t pairingStatusValue = PAIRING_STATUS_NOT_PAIRED; // Default to not paired
 
-        // Check current pairing status with the connected device
-        if (_connectedDevice && BLESecure.getPairingStatus() == PAIRING_COMPLETE)
+    _activeSlot = -1;
+    if (!valid[0] && !valid[1])
+    {
+#if PICO_WIFI_PROVISIONING_LEGACY_JSON
+        if (!anyStored)
         {
-            pairingStatusValue = PAIRING_STATUS_PAIRED; //
+            File legacyFile = _storage->openLegacyConfig();
+            if (legacyFile)
+            {
+                return migrateLegacyConfig(legacyFile);
+            }
         }
+#endif
+        Serial.println(anyStored ? "Failed to read WiFi configuration" : "No WiFi configuration found");
+        return false;
+    }
 
-        if (buffer == NULL)
-        { // Client is asking for the length only
-            return sizeof(pairingStatusValue);
+    uint8_t newest = (valid[1] && (!valid[0] || (int32_t)(sequence[1] - sequence[0]) > 0)) ? 1 : 0;
+    uint8_t order[2] = {newest, (uint8_t)(1 - newest)};
+    for (uint8_t i = 0; i < 2; i++)
+    {
+        uint8_t slot = order[i];
+        size_t size;
+        if (!valid[slot])
+        {
+            continue;
         }
-
-        if (buffer_size < sizeof(pairingStatusValue))
+        const uint8_t *image = readSlotImage(slot, size);
+        if (decodeNetworks(image, size))
         {
-            Serial.println("Error: Buffer too small for Pairing Status read.");
-            return 0;
+            _activeSlot = slot;
+            _configSequence = sequence[slot];
+            break;
         }
-
-        buffer[0] = pairingStatusValue;
-        // Serial.print("Read Pairing Status: "); Serial.println(pairingStatusValue); // Optional: for debugging
-        return sizeof(pairingStatusValue);
-    }
-
-    // If the characteristic_id is not handled by this function, return 0.
-    // This indicates to the stack that this callback did not provide data for this handle.
-    return 0;
-}
-
-bool PicoWiFiProvisioningClass::loadNetworksFromFlash()
-{
-    if (!LittleFS.exists(WIFI_CONFIG_FILE))
-    {
-        Serial.println("No WiFi configuration file found");
-        return false;
+        Serial.print("WiFi configuration slot ");
+        Serial.print(slot);
+        Serial.println(" is corrupt");
     }
-    File configFile = LittleFS.open(WIFI_CONFIG_FILE, "r");
-    if (!configFile)
+    if (_activeSlot < 0)
     {
-        Serial.println("Failed to open WiFi configuration file");
-        return false;
-    }
-    size_t fileSize = configFile.size();
-    if (fileSize > 2048)
-    { // Basic sanity check for file size
-        Serial.println("WiFi configuration file is too large");
-        configFile.close();
+        Serial.println("Failed to read WiFi configuration");
+        resetNetworks();
         return false;
     }
-    JsonDocument doc; // Using ArduinoJson V7 syntax, if applicable, else adjust for V6
-    DeserializationError error = deserializeJson(doc, configFile);
+    Serial.print("Loaded ");
+    Serial.print(_networkCount);
+    Serial.print(" WiFi networks from flash (");
+    Serial.print(_arenaUsed);
+    Serial.println(" arena bytes)");
+    _stats.loadCount++;
+    _stats.lastLoadMicros = micros() - startTime;
+    return true;
+}
+
+#if PICO_WIFI_PROVISIONING_LEGACY_JSON
+// Convert the legacy JSON config into the compact format. The JSON file is
+// only removed once the new image has been written and verified.
+bool PicoWiFiProvisioningClass::migrateLegacyConfig(File &configFile)
+{
+    unsigned long startTime = micros();
+    size_t legacySize = configFile.size();
+    resetNetworks();
+    bool parsed = parseNetworksJson(configFile);
     configFile.close();
-    if (error)
+    if (!parsed)
     {
-        Serial.print("Failed to parse WiFi configuration: ");
-        Serial.println(error.c_str());
+        Serial.println("Failed to parse WiFi configuration");
+        resetNetworks();
         return false;
     }
-    JsonArray networksArray = doc["networks"].as<JsonArray>();
-    _networkCount = 0;
-    for (JsonObject network : networksArray)
+    _stats.loadCount++;
+    _stats.lastLoadMicros = micros() - startTime;
+    if (!saveNetworksToFlash())
     {
-        if (_networkCount >= MAX_WIFI_NETWORKS)
-            break;
-        const char *ssid = network["ssid"];
-        const char *password = network["password"];
-        bool enabled = network["enabled"] | true; // Default to true if missing
-        if (ssid && strlen(ssid) > 0)
-        {
-            strncpy(_networks[_networkCount].ssid, ssid, MAX_SSID_LENGTH);
-            if (password)
-            {
-                strncpy(_networks[_networkCount].password, password, MAX_PASSWORD_LENGTH);
-            }
-            else
-            {
-                _networks[_networkCount].password[0] = '\0';
-            }
-            _networks[_networkCount].enabled = enabled;
-            _networkCount++;
-        }
+        Serial.println("Migration failed, keeping legacy WiFi configuration");
+        return true; // Networks are loaded, retry migration on next boot
     }
-    Serial.print("Loaded ");
+    _storage->removeLegacyConfig();
+    _stats.lastMigrationMicros = micros() - startTime;
+    _stats.legacyConfigBytes = legacySize;
+    _stats.migratedConfigBytes = encodeNetworks(configImage, sizeof(configImage), _configSequence);
+    Serial.print("Migrated ");
     Serial.print(_networkCount);
-    Serial.println(" WiFi networks from flash");
+    Serial.print(" WiFi networks from JSON (");
+    Serial.print(_stats.legacyConfigBytes);
+    Serial.print(" bytes) to compact format (");
+    Serial.print(_stats.migratedConfigBytes);
+    Serial.print(" bytes) in ");
+    Serial.print(_stats.lastMigrationMicros);
+    Serial.println(" us");
     return true;
 }
+#endif // PICO_WIFI_PROVISIONING_LEGACY_JSON
 
+// Write the next sequence number into the older slot, never the active one
 bool PicoWiFiProvisioningClass::saveNetworksToFlash()
 {
-    JsonDocument doc;
-    JsonArray networksArray = doc["networks"].to<JsonArray>();
-    for (int i = 0; i < _networkCount; i++)
+    if (!ensureStorage())
     {
-        JsonObject network = networksArray.add<JsonObject>();
-        network["ssid"] = _networks[i].ssid;
-        network["password"] = _networks[i].password;
-        network["enabled"] = _networks[i].enabled;
-    }
-    File configFile = LittleFS.open(WIFI_CONFIG_FILE, "w");
-    if (!configFile)
-    {
-        Serial.println("Failed to open WiFi configuration file for writing");
         return false;
     }
-    if (serializeJson(doc, configFile) == 0)
+    unsigned long startTime = micros();
+    uint8_t slot = (_storage->slotCount() > 1 && _activeSlot == 0) ? 1 : 0;
+    size_t size = encodeNetworks(configImage, sizeof(configImage), _configSequence + 1);
+    if (size == 0 || !_storage->write(slot, configImage, size))
     {
-        Serial.println("Failed to write WiFi configuration to file");
-        configFile.close();
+        Serial.println("Failed to save WiFi networks to flash");
         return false;
     }
-    configFile.close();
+    _activeSlot = slot;
+    _configSequence++;
     Serial.println("WiFi networks saved to flash");
+    _stats.saveCount++;
+    _stats.bytesWritten += size;
+    _stats.lastImageBytes = size;
+    _stats.lastSaveMicros = micros() - startTime;
     return true;
 }
 
@@ -611,35 +2797,72 @@ void PicoWiFiProvisioningClass::setupBLEService()
         &_commandCharUUID, ATT_PROPERTY_WRITE);
     _pairingStatusCharHandle = BLENotify.addNotifyCharacteristic(
         &_pairingStatusCharUUID, ATT_PROPERTY_READ | ATT_PROPERTY_NOTIFY);
+    _statusCharHandle = BLENotify.addNotifyCharacteristic(
+        &_statusCharUUID, ATT_PROPERTY_READ | ATT_PROPERTY_NOTIFY);
     updatePairingStatusCharacteristic(false); // Initial status
     Serial.println("BLE service and characteristics set up");
 }
 
-void PicoWiFiProvisioningClass::processCommand(uint8_t command)
+int PicoWiFiProvisioningClass::commandTarget(const uint8_t *args, uint16_t argsLength, uint16_t indexPos)
+{
+    ensureNetworksLoaded();
+    int index = -1;
+    if (argsLength > indexPos)
+    { // An explicit index wins over a leftover SSID
+        index = args[indexPos] < _networkCount ? args[indexPos] : -1;
+    }
+    else if (strlen(_receivedSSID) > 0)
+    {
+        index = findNetwork(_receivedSSID);
+    }
+    memset(_receivedSSID, 0, sizeof(_receivedSSID));
+    if (index < 0)
+    {
+        Serial.println("No stored network matches the command");
+    }
+    return index;
+}
+
+void PicoWiFiProvisioningClass::processCommand(uint8_t command, const uint8_t *args, uint16_t argsLength)
 {
+    int index;
     Serial.print("Received command: 0x");
     Serial.println(command, HEX);
     switch (command)
     {
     case CMD_SAVE_NETWORK:
+        recordSessionMilestone();
         if (strlen(_receivedSSID) > 0)
         {
-            if (saveNetwork(_receivedSSID, _receivedPassword))
+            if (_validateBeforeSave)
+            {
+                Serial.println("Validating network before saving it");
+                if (!validateAndSaveNetwork(_receivedSSID, _receivedPassword))
+                {
+                    updateStatusCharacteristic(STATUS_FAILED);
+                }
+            }
+            else if (saveNetwork(_receivedSSID, _receivedPassword))
             {
                 Serial.println("Network saved successfully");
+                reportSaveWhenCommitted();
             }
             else
             {
                 Serial.println("Failed to save network");
+                updateStatusCharacteristic(STATUS_FAILED);
             }
             memset(_receivedSSID, 0, sizeof(_receivedSSID));
             memset(_receivedPassword, 0, sizeof(_receivedPassword));
         }
         break;
     case CMD_CONNECT:
+        recordSessionMilestone();
         if (strlen(_receivedSSID) > 0)
         {
             connectToNetwork(_receivedSSID, _receivedPassword);
+            memset(_receivedSSID, 0, sizeof(_receivedSSID));
+            memset(_receivedPassword, 0, sizeof(_receivedPassword));
         }
         else
         {
@@ -655,7 +2878,78 @@ void PicoWiFiProvisioningClass::processCommand(uint8_t command)
         setStatus(PROVISION_IDLE); // Revert to idle after explicit disconnect command
         Serial.println("WiFi disconnect command processed.");
         break;
-    // CMD_GET_STATUS, CMD_START_SCAN, CMD_GET_SCAN_RESULTS are not fully implemented here
+    case CMD_DELETE_NETWORK:
+        index = commandTarget(args, argsLength, 0);
+        if (index >= 0)
+        {
+            deleteNetworkAt(index);
+        }
+        break;
+    case CMD_ENABLE_NETWORK:
+    case CMD_DISABLE_NETWORK:
+        index = commandTarget(args, argsLength, 0);
+        if (index >= 0)
+        {
+            setNetworkEnabledAt(index, command == CMD_ENABLE_NETWORK);
+        }
+        break;
+    case CMD_STAGE_NETWORK:
+        recordSessionMilestone();
+        if (stageNetworkUpdate(_receivedSSID, _receivedPassword,
+                               argsLength >= 1 ? args[0] : 3, argsLength >= 2 ? args[1] : 3))
+        {
+            reportSaveWhenCommitted();
+        }
+        else
+        {
+            Serial.println("Failed to stage network update");
+            updateStatusCharacteristic(STATUS_FAILED);
+        }
+        memset(_receivedSSID, 0, sizeof(_receivedSSID));
+        memset(_receivedPassword, 0, sizeof(_receivedPassword));
+        break;
+    case CMD_SET_PRIORITY:
+        if (argsLength < 1)
+        {
+            Serial.println("CMD_SET_PRIORITY needs a priority byte");
+            break;
+        }
+        index = commandTarget(args, argsLength, 1);
+        if (index >= 0)
+        {
+            setNetworkPriorityAt(index, args[0]);
+        }
+        break;
+    case CMD_SET_STATIC_IP:
+        if (argsLength >= 16)
+        {
+            index = commandTarget(args, argsLength, 16);
+            if (index >= 0)
+            {
+                setNetworkStaticIPAt(index, IPAddress(args[0], args[1], args[2], args[3]),
+                                     IPAddress(args[4], args[5], args[6], args[7]),
+                                     IPAddress(args[8], args[9], args[10], args[11]),
+                                     IPAddress(args[12], args[13], args[14], args[15]));
+            }
+        }
+        else if (argsLength <= 1)
+        { // No settings: back to DHCP
+            index = commandTarget(args, argsLength, 0);
+            if (index >= 0)
+            {
+                setNetworkStaticIPAt(index, IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0),
+                                     IPAddress(0, 0, 0, 0), IPAddress(0, 0, 0, 0));
+            }
+        }
+        else
+        {
+            Serial.println("CMD_SET_STATIC_IP needs 16 bytes of settings or none");
+        }
+        break;
+    case CMD_GET_STATUS:
+        updateStatusCharacteristic(_statusCode); // Re-send the current status
+        break;
+    // CMD_START_SCAN, CMD_GET_SCAN_RESULTS are not fully implemented here
     default:
         Serial.println("Unknown command received.");
         break;
@@ -0,0 +1,418 @@
+/**
+ * PicoWiFiProvisioningStorage.cpp - Storage backends for PicoWiFiProvisioning
+ *
+ * Implementation file for the LittleFS, flash sector, EEPROM and RAM backends.
+ */
+
+#include "PicoWiFiProvisioningStorage.h"
+#include <EEPROM.h>
+#include <hardware/flash.h>
+
+// ---------------------------------------------------------------------------
+// LittleFS
+// ---------------------------------------------------------------------------
+
+bool PicoWiFiLittleFSStorage::begin()
+{
+    if (!LittleFS.begin())
+    {
+        Serial.println("Failed to initialize LittleFS");
+        return false;
+    }
+    return true;
+}
+
+static const char *slotFile(uint8_t slot)
+{
+    return slot == 0 ? WIFI_CONFIG_BIN_FILE : WIFI_CONFIG_BIN_B_FILE;
+}
+
+size_t PicoWiFiLittleFSStorage::read(uint8_t slot, size_t offset, uint8_t *buffer, size_t size)
+{
+    if (!LittleFS.exists(slotFile(slot)))
+    {
+        return 0;
+    }
+    File file = LittleFS.open(slotFile(slot), "r");
+    if (!file)
+    {
+        return 0;
+    }
+    size_t bytesRead = 0;
+    if (file.seek(offset))
+    {
+        bytesRead = file.read(buffer, size);
+    }
+    file.close();
+    return bytesRead;
+}
+
+// Write the image to the slot file and verify it. The library only ever
+// writes the older slot, so a failed write never touches the newest image.
+bool PicoWiFiLittleFSStorage::write(uint8_t slot, const uint8_t *image, size_t size)
+{
+    const char *path = slotFile(slot);
+    File file = LittleFS.open(path, "w");
+    if (!file)
+    {
+        Serial.println("Failed to open WiFi configuration file for writing");
+        return false;
+    }
+    size_t written = file.write(image, size);
+    file.close();
+    if (written != size)
+    {
+        Serial.println("Failed to write WiFi configuration to file");
+        LittleFS.remove(path);
+        return false;
+    }
+
+    // Read back in small chunks so the image buffer is not needed twice
+    file = LittleFS.open(path, "r");
+    bool verified = file && file.size() == size;
+    uint8_t chunk[32];
+    for (size_t pos = 0; verified && pos < size; pos += sizeof(chunk))
+    {
+        size_t n = min(sizeof(chunk), size - pos);
+        verified = file.read(chunk, n) == n && memcmp(chunk, image + pos, n) == 0;
+    }
+    if (file)
+    {
+        file.close();
+    }
+    if (!verified)
+    {
+        Serial.println("WiFi configuration verification failed");
+        LittleFS.remove(path);
+        return false;
+    }
+    return true;
+}
+
+bool PicoWiFiLittleFSStorage::erase()
+{
+    if (LittleFS.exists(WIFI_CONFIG_BIN_FILE))
+    {
+        LittleFS.remove(WIFI_CONFIG_BIN_FILE);
+    }
+    if (LittleFS.exists(WIFI_CONFIG_BIN_B_FILE))
+    {
+        LittleFS.remove(WIFI_CONFIG_BIN_B_FILE);
+    }
+    if (LittleFS.exists(WIFI_CONFIG_FILE))
+    {
+        LittleFS.remove(WIFI_CONFIG_FILE);
+    }
+    return true;
+}
+
+#if PICO_WIFI_PROVISIONING_LEGACY_JSON
+File PicoWiFiLittleFSStorage::openLegacyConfig()
+{
+    if (!LittleFS.exists(WIFI_CONFIG_FILE))
+    {
+        return File();
+    }
+    return LittleFS.open(WIFI_CONFIG_FILE, "r");
+}
+
+void PicoWiFiLittleFSStorage::removeLegacyConfig()
+{
+    LittleFS.remove(WIFI_CONFIG_FILE);
+}
+#endif
+
+// ---------------------------------------------------------------------------
+// Raw flash sector
+// ---------------------------------------------------------------------------
+
+// Record layout, starting on a page boundary:
+// magic(4) sequence(4) image length(2) inverted image length(2), image
+static const uint32_t FLASH_RECORD_MAGIC = 0x52465750; // "PWFR"
+static const size_t FLASH_RECORD_HEADER_SIZE = 12;
+
+struct FlashRecordHeader
+{
+    uint32_t magic;
+    uint32_t sequence;
+    uint16_t length;
+    uint16_t lengthInverted;
+};
+
+static size_t flashRecordPages(size_t imageSize)
+{
+    return (FLASH_RECORD_HEADER_SIZE + imageSize + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+}
+
+PicoWiFiFlashSectorStorage::PicoWiFiFlashSectorStorage(uint32_t flashOffset, uint8_t sectorCount) : _flashOffset(flashOffset),
+                                                                                                    _sectorCount(sectorCount),
+                                                                                                    _recordOffset(0),
+                                                                                                    _recordSize(0),
+                                                                                                    _sequence(0),
+                                                                                                    _nextOffset(0),
+                                                                                                    _hasRecord(false)
+{
+}
+
+// Find the newest record by walking the record headers through XIP
+bool PicoWiFiFlashSectorStorage::begin()
+{
+    if (_flashOffset % FLASH_SECTOR_SIZE != 0 || _sectorCount < 2 ||
+        _flashOffset + _sectorCount * FLASH_SECTOR_SIZE > PICO_FLASH_SIZE_BYTES)
+    {
+        Serial.println("Invalid flash sectors for WiFi configuration");
+        return false;
+    }
+    const uint8_t *base = (const uint8_t *)(XIP_BASE + _flashOffset);
+    _hasRecord = false;
+    _nextOffset = 0;
+    for (uint32_t sector = 0; sector < _sectorCount; sector++)
+    {
+        uint32_t pos = sector * FLASH_SECTOR_SIZE;
+        uint32_t sectorEnd = pos + FLASH_SECTOR_SIZE;
+        while (pos < sectorEnd)
+        {
+            FlashRecordHeader header;
+            memcpy(&header, base + pos, sizeof(header));
+            uint32_t recordEnd = pos + flashRecordPages(header.length) * FLASH_PAGE_SIZE;
+            if (header.magic != FLASH_RECORD_MAGIC || (uint16_t)~header.length != header.lengthInverted ||
+                recordEnd > sectorEnd)
+            {
+                break;
+            }
+            if (!_hasRecord || (int32_t)(header.sequence - _sequence) > 0)
+            {
+                _hasRecord = true;
+                _sequence = header.sequence;
+                _recordOffset = pos;
+                _recordSize = header.length;
+                _nextOffset = recordEnd;
+            }
+            pos = recordEnd;
+        }
+    }
+    return true;
+}
+
+const uint8_t *PicoWiFiFlashSectorStorage::map(uint8_t slot, size_t &size)
+{
+    if (!_hasRecord)
+    {
+        size = 0;
+        return nullptr;
+    }
+    size = _recordSize;
+    return (const uint8_t *)(XIP_BASE + _flashOffset + _recordOffset + FLASH_RECORD_HEADER_SIZE);
+}
+
+size_t PicoWiFiFlashSectorStorage::read(uint8_t slot, size_t offset, uint8_t *buffer, size_t size)
+{
+    size_t length;
+    const uint8_t *image = map(slot, length);
+    if (!image || offset >= length)
+    {
+        return 0;
+    }
+    size_t n = min(size, length - offset);
+    memcpy(buffer, image + offset, n);
+    return n;
+}
+
+bool PicoWiFiFlashSectorStorage::isErased(uint32_t offset, size_t size)
+{
+    const uint8_t *flash = (const uint8_t *)(XIP_BASE + _flashOffset + offset);
+    for (size_t i = 0; i < size; i++)
+    {
+        if (flash[i] != 0xFF)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PicoWiFiFlashSectorStorage::write(uint8_t slot, const uint8_t *image, size_t size)
+{
+    size_t recordBytes = flashRecordPages(size) * FLASH_PAGE_SIZE;
+    if (recordBytes > FLASH_SECTOR_SIZE)
+    {
+        return false;
+    }
+
+    // Append to the current sector if the record fits in still-erased space,
+    // otherwise start over in the next sector. Without a record, _nextOffset
+    // points at the sector after the one used last (see erase())
+    uint32_t offset = _nextOffset;
+    uint32_t sector = (_hasRecord ? _recordOffset : _nextOffset) / FLASH_SECTOR_SIZE;
+    bool needErase = false;
+    if (offset + recordBytes > (sector + 1) * FLASH_SECTOR_SIZE || !isErased(offset, recordBytes))
+    {
+        if (_hasRecord)
+        {
+            sector = (sector + 1) % _sectorCount;
+        }
+        offset = sector * FLASH_SECTOR_SIZE;
+        needErase = true;
+    }
+
+    // Program the image pages with the header left erased, then the header
+    // on its own, so a record is never valid before all of its data is
+    FlashRecordHeader header = {FLASH_RECORD_MAGIC, _sequence + 1, (uint16_t)size, (uint16_t)~size};
+    uint8_t page[FLASH_PAGE_SIZE];
+    noInterrupts();
+    rp2040.idleOtherCore();
+    if (needErase)
+    {
+        flash_range_erase(_flashOffset + offset, FLASH_SECTOR_SIZE);
+    }
+    for (size_t pos = 0; pos < recordBytes; pos += FLASH_PAGE_SIZE)
+    {
+        memset(page, 0xFF, sizeof(page));
+        for (size_t i = 0; i < FLASH_PAGE_SIZE; i++)
+        {
+            size_t at = pos + i;
+            if (at >= FLASH_RECORD_HEADER_SIZE && at < FLASH_RECORD_HEADER_SIZE + size)
+            {
+                page[i] = image[at - FLASH_RECORD_HEADER_SIZE];
+            }
+        }
+        flash_range_program(_flashOffset + offset + pos, page, FLASH_PAGE_SIZE);
+    }
+    memset(page, 0xFF, sizeof(page));
+    memcpy(page, &header, sizeof(header));
+    flash_range_program(_flashOffset + offset, page, FLASH_PAGE_SIZE);
+    rp2040.resumeOtherCore();
+    interrupts();
+
+    _hasRecord = true;
+    _sequence = header.sequence;
+    _recordOffset = offset;
+    _recordSize = size;
+    _nextOffset = offset + recordBytes;
+    return true;
+}
+
+bool PicoWiFiFlashSectorStorage::erase()
+{
+    noInterrupts();
+    rp2040.idleOtherCore();
+    flash_range_erase(_flashOffset, _sectorCount * FLASH_SECTOR_SIZE);
+    rp2040.resumeOtherCore();
+    interrupts();
+    // Continue in the sector after the last used one so clears do not keep
+    // sending the first write to the same sector
+    if (_hasRecord)
+    {
+        _nextOffset = ((_recordOffset / FLASH_SECTOR_SIZE + 1) % _sectorCount) * FLASH_SECTOR_SIZE;
+    }
+    else
+    {
+        _nextOffset = (_nextOffset / FLASH_SECTOR_SIZE % _sectorCount) * FLASH_SECTOR_SIZE;
+    }
+    _hasRecord = false;
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// EEPROM emulation
+// ---------------------------------------------------------------------------
+
+// Layout at offset: image length (2 bytes) followed by the image
+static const size_t EEPROM_LENGTH_SIZE = 2;
+
+PicoWiFiEEPROMStorage::PicoWiFiEEPROMStorage(uint16_t offset) : _offset(offset)
+{
+}
+
+bool PicoWiFiEEPROMStorage::begin()
+{
+    size_t needed = _offset + EEPROM_LENGTH_SIZE + WIFI_CONFIG_IMAGE_MAX_SIZE;
+    if (needed > FLASH_SECTOR_SIZE)
+    {
+        Serial.println("WiFi configuration does not fit in EEPROM");
+        return false;
+    }
+    if (EEPROM.length() < needed)
+    {
+        EEPROM.begin(needed);
+    }
+    return true;
+}
+
+size_t PicoWiFiEEPROMStorage::read(uint8_t slot, size_t offset, uint8_t *buffer, size_t size)
+{
+    uint16_t length = EEPROM.read(_offset) | (EEPROM.read(_offset + 1) << 8);
+    if (length > WIFI_CONFIG_IMAGE_MAX_SIZE || offset >= length)
+    {
+        return 0;
+    }
+    size_t n = min(size, (size_t)(length - offset));
+    for (size_t i = 0; i < n; i++)
+    {
+        buffer[i] = EEPROM.read(_offset + EEPROM_LENGTH_SIZE + offset + i);
+    }
+    return n;
+}
+
+bool PicoWiFiEEPROMStorage::write(uint8_t slot, const uint8_t *image, size_t size)
+{
+    if (size > WIFI_CONFIG_IMAGE_MAX_SIZE)
+    {
+        return false;
+    }
+    EEPROM.write(_offset, size & 0xFF);
+    EEPROM.write(_offset + 1, size >> 8);
+    for (size_t i = 0; i < size; i++)
+    {
+        EEPROM.write(_offset + EEPROM_LENGTH_SIZE + i, image[i]);
+    }
+    return EEPROM.commit();
+}
+
+bool PicoWiFiEEPROMStorage::erase()
+{
+    EEPROM.write(_offset, 0);
+    EEPROM.write(_offset + 1, 0);
+    return EEPROM.commit();
+}
+
+// ---------------------------------------------------------------------------
+// RAM
+// ---------------------------------------------------------------------------
+
+PicoWiFiRAMStorage::PicoWiFiRAMStorage() : _size(0)
+{
+}
+
+bool PicoWiFiRAMStorage::begin()
+{
+    return true;
+}
+
+size_t PicoWiFiRAMStorage::read(uint8_t slot, size_t offset, uint8_t *buffer, size_t size)
+{
+    if (offset >= _size)
+    {
+        return 0;
+    }
+    size_t n = min(size, _size - offset);
+    memcpy(buffer, _image + offset, n);
+    return n;
+}
+
+bool PicoWiFiRAMStorage::write(uint8_t slot, const uint8_t *image, size_t size)
+{
+    if (size > sizeof(_image))
+    {
+        return false;
+    }
+    memcpy(_image, image, size);
+    _size = size;
+    return true;
+}
+
+bool PicoWiFiRAMStorage::erase()
+{
+    _size = 0;
+    return true;
+}